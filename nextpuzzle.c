@@ -1,11 +1,21 @@
 #include <stdio.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <poll.h>
 #include <regex.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <sqlite3.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,17 +23,31 @@
 #include "nextpuzzle.h"
 
 char const *dbfh = "dailypuzzles.sqlite";
+char const *metrics_file = "dailypuzzles.metrics";
+char const *spool_file = "dailypuzzles.spool";
+char const *sandbox_uri = "file:/nextpuzzle-sandbox?vfs=memdb";
 char const *create_puzzles_table = "create table puzzles (id integer primary key autoincrement, puzzle_id text not null, score integer default 0, next_test_date text not null)";
 char const *create_results_table = "create table results (id integer primary key autoincrement, puzzle_id text not null, date text not null, result text not null)";
 char const *puzzle_exists_statement = "select 1 from puzzles where puzzle_id=:puzzleid";
 char const *insert_puzzle_statement = "insert into puzzles (puzzle_id, score, next_test_date) values (:puzzle_id, :score, :next_test_date)";
 char const *insert_result_statement = "insert into results (puzzle_id, date, result) values (:puzzle_id, :date, :result)";
 char const *update_puzzle_statement = "update puzzles set score=:score, next_test_date=:next_test_date where puzzle_id=:puzzle_id";
-char const *get_next_test_statement = "select puzzle_id from puzzles where next_test_date<=:next_test_date";
 char const *get_next_test_date_for_puzzle_statement = "select next_test_date from puzzles where puzzle_id=:puzzle_id";
-char const *get_puzzle_at_offset_statement = "select puzzle_id from puzzles where next_test_date<=:next_test_date limit 1 offset :offset";
-char const *get_total_remaining_tests_statement = "select count(*) from puzzles where next_test_date<=:next_test_date";
-char const *get_upcomming_puzzles_count_by_date = "select next_test_date, count(*) as total from puzzles group by next_test_date";
+char const *get_puzzle_at_offset_overdue_statement = "select puzzle_id from puzzles where next_test_date<=:next_test_date and (:theme is null or exists (select 1 from catalog_themes t where t.theme=:theme and t.puzzle_id=puzzles.puzzle_id)) and (:min_rating is null or exists (select 1 from catalog c where c.puzzle_id=puzzles.puzzle_id and c.rating between :min_rating and :max_rating)) order by next_test_date, id limit 1 offset :offset";
+char const *get_puzzle_at_offset_score_statement = "select puzzle_id from puzzles where +next_test_date<=:next_test_date and (:theme is null or exists (select 1 from catalog_themes t where t.theme=:theme and t.puzzle_id=puzzles.puzzle_id)) and (:min_rating is null or exists (select 1 from catalog c where c.puzzle_id=puzzles.puzzle_id and c.rating between :min_rating and :max_rating)) order by score, next_test_date, id limit 1 offset :offset";
+char const *get_puzzle_at_offset_random_statement = "select puzzle_id from puzzles where +next_test_date<=:next_test_date and (:theme is null or exists (select 1 from catalog_themes t where t.theme=:theme and t.puzzle_id=puzzles.puzzle_id)) and (:min_rating is null or exists (select 1 from catalog c where c.puzzle_id=puzzles.puzzle_id and c.rating between :min_rating and :max_rating)) order by shuffle_key, id limit 1 offset :offset";
+char const *get_total_remaining_tests_statement = "select coalesce(sum(count), 0) from due_counts where day<=:next_test_date";
+char const *get_upcomming_puzzles_count_by_date = "select day, count from due_counts where day>=:day order by day";
+char const *get_total_remaining_filtered_tests_statement = "select count(*) from puzzles where next_test_date<=:next_test_date and (:theme is null or exists (select 1 from catalog_themes t where t.theme=:theme and t.puzzle_id=puzzles.puzzle_id)) and (:min_rating is null or exists (select 1 from catalog c where c.puzzle_id=puzzles.puzzle_id and c.rating between :min_rating and :max_rating))";
+char const *insert_catalog_statement = "insert or replace into catalog (puzzle_id, rating) values (:puzzle_id, :rating)";
+char const *delete_catalog_themes_statement = "delete from catalog_themes where puzzle_id=:puzzle_id";
+char const *insert_catalog_theme_statement = "insert or ignore into catalog_themes (theme, puzzle_id) values (:theme, :puzzle_id)";
+char const *bulk_load_cache_statement = "pragma cache_size=-65536";
+char const *snapshot_journal_mode_statement = "pragma journal_mode=off";
+char const *get_plan_puzzles_statement = "select puzzle_id, next_test_date, score, id, shuffle_key from puzzles";
+char const *set_shuffle_keys_statement = "update puzzles set shuffle_key=(id * :multiplier) % 2147483647";
+char const *get_next_due_day_statement = "select min(day) from due_counts where day>:day";
+char const *get_overdue_puzzles_count = "select coalesce(sum(count), 0) from due_counts where day<:day";
 char const *get_score_for_puzzle_statement = "select score from puzzles where puzzle_id=:puzzle_id";
 char const *get_overall_failure_success_rate_statement = "select sum(case when result=\"f\" then 1.0 else 0.0 end)/count(*) * 100 as failure_rate, sum(case when result=\"s\" then 1.0 else 0.0 end)/count(*) * 100 as success_rate from results";
 char const *get_individual_puzzle_stats_statement = "select puzzle_id, score, (select count(1) from results rs where result='s' and pz.puzzle_id=rs.puzzle_id) as success, (select count(1) from results rs where result='f' and pz.puzzle_id=rs.puzzle_id) as failure, (select count(1) from results rs where pz.puzzle_id=rs.puzzle_id) as attempts from puzzles pz order by score desc, success desc, failure asc";
@@ -31,9 +55,115 @@ char const *set_puzzle_date_statement = "update puzzles set next_test_date=:next
 char const *delete_puzzle_from_puzzles_statement = "delete from puzzles where puzzle_id=:puzzle_id";
 char const *delete_puzzle_from_results_statement = "delete from results where puzzle_id=:puzzle_id";
 char const *get_scores_for_date = "select score, count(score) from puzzles where next_test_date=:next_test_date group by score";
-char const *begin_transaction_statement = "begin transacton";
+char const *begin_transaction_statement = "begin transaction";
+char const *begin_immediate_statement = "begin immediate";
 char const *commit_transaction_statement = "commit";
 char const *rollback_transaction_statememt = "rollback";
+char const *get_schema_version_statement = "pragma user_version";
+char const *get_replay_results_statement = "select puzzle_id, date, result from results where date<=:date order by puzzle_id, date, id";
+char const *get_puzzle_history_statement = "select date, result from \"%w\".results where puzzle_id=:puzzle_id and date<=:date order by date, id";
+char const *get_partition_results_statement = "select puzzle_id, date, result from results where puzzle_id>=:first_puzzle_id and puzzle_id<=:last_puzzle_id and date<=:date order by puzzle_id, date, id";
+char const *get_all_puzzle_ids_statement = "select puzzle_id from puzzles order by puzzle_id";
+char const *reschedule_puzzle_statement = "update puzzles set score=:score, next_test_date=:next_test_date where puzzle_id=:puzzle_id and (score!=:score or next_test_date!=:next_test_date)";
+char const *insert_spool_applied_statement = "insert or ignore into spool_applied (key) values (:key)";
+char const *create_spool_seen_statement = "create temp table if not exists spool_seen (key text primary key) without rowid; delete from spool_seen";
+char const *insert_spool_seen_statement = "insert or ignore into spool_seen (key) values (:key)";
+char const *prune_spool_applied_statement = "delete from spool_applied where key not in (select key from spool_seen)";
+char const *integrity_check_statement = "pragma integrity_check";
+char const *quick_check_statement = "pragma quick_check";
+char const *analyze_statement = "pragma analysis_limit=" MAINTAIN_ANALYSIS_LIMIT "; analyze";
+char const *get_freelist_count_statement = "pragma freelist_count";
+char const *get_page_count_statement = "pragma page_count";
+char const *get_page_size_statement = "pragma page_size";
+char const *get_auto_vacuum_statement = "pragma auto_vacuum";
+char const *set_incremental_vacuum_statement = "pragma auto_vacuum=incremental";
+char const *convert_to_incremental_vacuum_statement = "pragma auto_vacuum=incremental; vacuum";
+char const *get_setting_statement = "select value from \"%w\".settings where key=:key";
+char const *set_setting_statement = "insert into \"%w\".settings (key, value) values (:key, :value) on conflict(key) do update set value=excluded.value";
+char const *attach_sync_database_statement = "attach database :path as other";
+char const *detach_sync_database_statement = "detach database other";
+char const *check_results_table_statement = "select count(*) from \"%w\".sqlite_master where type='table' and name='results'";
+char const *create_synced_puzzles_table = "create temp table if not exists synced_puzzles (schema_name text not null, puzzle_id text not null, primary key (schema_name, puzzle_id)) without rowid";
+char const *get_max_result_id_statement = "select coalesce(max(id), 0) from \"%w\".results";
+char const *find_synced_puzzles_statement = "insert or ignore into temp.synced_puzzles (schema_name, puzzle_id) select :dest_schema, puzzle_id from \"%w\".results where id>:high_water and coalesce(origin, :source_id)!=:dest_id";
+char const *copy_synced_results_statement = "insert or ignore into \"%w\".results (puzzle_id, date, result, origin, origin_id) select puzzle_id, date, result, coalesce(origin, :source_id), coalesce(origin_id, id) from \"%w\".results where id>:high_water and coalesce(origin, :source_id)!=:dest_id order by id";
+char const *get_synced_puzzles_statement = "select puzzle_id from temp.synced_puzzles where schema_name=:schema_name";
+char const *update_synced_puzzle_statement = "update \"%w\".puzzles set score=:score, next_test_date=:next_test_date where puzzle_id=:puzzle_id";
+char const *insert_synced_puzzle_statement = "insert into \"%w\".puzzles (puzzle_id, score, next_test_date) values (:puzzle_id, :score, :next_test_date)";
+char const *create_rebuilt_puzzles_table = "create temp table rebuilt_puzzles (puzzle_id text primary key, score integer not null, next_test_date text not null) without rowid";
+char const *insert_rebuilt_puzzle_statement = "insert into rebuilt_puzzles (puzzle_id, score, next_test_date) values (:puzzle_id, :score, :next_test_date)";
+char const *count_rebuilt_changed_statement = "select count(*) from puzzles p join rebuilt_puzzles r on r.puzzle_id=p.puzzle_id where p.score!=r.score or p.next_test_date!=r.next_test_date";
+char const *count_rebuilt_added_statement = "select count(*) from rebuilt_puzzles r where not exists (select 1 from puzzles p where p.puzzle_id=r.puzzle_id)";
+char const *count_rebuilt_removed_statement = "select count(*) from puzzles p where not exists (select 1 from rebuilt_puzzles r where r.puzzle_id=p.puzzle_id)";
+char const *apply_rebuilt_changed_statement = "update puzzles set score=(select r.score from rebuilt_puzzles r where r.puzzle_id=puzzles.puzzle_id), next_test_date=(select r.next_test_date from rebuilt_puzzles r where r.puzzle_id=puzzles.puzzle_id) where exists (select 1 from rebuilt_puzzles r where r.puzzle_id=puzzles.puzzle_id and (r.score!=puzzles.score or r.next_test_date!=puzzles.next_test_date))";
+char const *apply_rebuilt_added_statement = "insert into puzzles (puzzle_id, score, next_test_date) select puzzle_id, score, next_test_date from rebuilt_puzzles r where not exists (select 1 from puzzles p where p.puzzle_id=r.puzzle_id) order by puzzle_id";
+char const *apply_rebuilt_removed_statement = "delete from puzzles where not exists (select 1 from rebuilt_puzzles r where r.puzzle_id=puzzles.puzzle_id)";
+char const *drop_rebuilt_puzzles_table = "drop table temp.rebuilt_puzzles";
+/* schema_migrations are applied in order to bring an existing database up to
+ * date.  The database records how many have run in its user_version pragma, so
+ * new entries must only ever be appended */
+char const *schema_migrations[] = {
+  "create index if not exists puzzles_puzzle_id_idx on puzzles (puzzle_id);"
+  "create index if not exists results_replay_idx on results (puzzle_id, date, id, result);",
+  /* due_counts is a histogram of puzzles per next_test_date kept in step with
+   * puzzles by triggers, so it changes in the same transaction as the puzzle */
+  "create table if not exists due_counts (day text primary key, count integer not null) without rowid;"
+  "delete from due_counts;"
+  "insert into due_counts (day, count) select next_test_date, count(*) from puzzles group by next_test_date;"
+  "create trigger if not exists puzzles_due_insert after insert on puzzles begin"
+  " insert into due_counts (day, count) values (new.next_test_date, 1) on conflict(day) do update set count=count+1;"
+  " end;"
+  "create trigger if not exists puzzles_due_delete after delete on puzzles begin"
+  " update due_counts set count=count-1 where day=old.next_test_date;"
+  " delete from due_counts where day=old.next_test_date and count<=0;"
+  " end;"
+  "create trigger if not exists puzzles_due_update after update of next_test_date on puzzles when old.next_test_date!=new.next_test_date begin"
+  " update due_counts set count=count-1 where day=old.next_test_date;"
+  " delete from due_counts where day=old.next_test_date and count<=0;"
+  " insert into due_counts (day, count) values (new.next_test_date, 1) on conflict(day) do update set count=count+1;"
+  " end;",
+  /* one covering index per queue order so the head of the queue is read
+   * straight off an index instead of sorting the due puzzles.  The score and
+   * random statements filter on +next_test_date so the planner walks these in
+   * order rather than searching the date range.  The random order's
+   * expression index is replaced by one on the stored shuffle_key below */
+  "create index if not exists puzzles_queue_overdue_idx on puzzles (next_test_date, id, puzzle_id);"
+  "create index if not exists puzzles_queue_score_idx on puzzles (score, next_test_date, id, puzzle_id);"
+  "create index if not exists puzzles_queue_random_idx on puzzles ((id * 48271) % 2147483647, id, next_test_date, puzzle_id);",
+  /* catalog holds puzzle metadata loaded with catalog import, keyed so the
+   * --theme and --rating queue filters are answered by index lookups */
+  "create table if not exists catalog (puzzle_id text primary key, rating integer) without rowid;"
+  "create index if not exists catalog_rating_idx on catalog (rating, puzzle_id);"
+  "create table if not exists catalog_themes (theme text not null, puzzle_id text not null, primary key (theme, puzzle_id)) without rowid;"
+  "create index if not exists catalog_themes_puzzle_idx on catalog_themes (puzzle_id);",
+  "create table if not exists settings (key text primary key, value text not null) without rowid;",
+  /* results copied in by sync remember the database (db_id) and row they
+   * were first recorded in, so the same result is never stored twice */
+  "alter table results add column origin text;"
+  "alter table results add column origin_id integer;"
+  "create unique index if not exists results_origin_idx on results (origin, origin_id) where origin is not null;"
+  "insert or ignore into settings (key, value) values ('db_id', lower(hex(randomblob(16))));",
+  /* spool_applied holds the keys of spooled results recorded since the spool
+   * was last emptied */
+  "create table if not exists spool_applied (key text primary key) without rowid;",
+  /* shuffle_key is a puzzle's place in the random order, its id times the
+   * multiplier for the seed set with shuffle --seed modulo 2^31 - 1.  It is
+   * stored rather than indexed as an expression so the seed can be changed */
+  "alter table puzzles add column shuffle_key integer;"
+  "update puzzles set shuffle_key=(id * 48271) % 2147483647;"
+  "drop index if exists puzzles_queue_random_idx;"
+  "create index if not exists puzzles_queue_shuffle_idx on puzzles (shuffle_key, id, next_test_date, puzzle_id);"
+  "create trigger if not exists puzzles_shuffle_key after insert on puzzles begin"
+  " update puzzles set shuffle_key=(new.id * coalesce((select cast(value as integer) from settings where key='shuffle_multiplier'), 48271)) % 2147483647 where id=new.id;"
+  " end;",
+  /* the --rating filter looks each due puzzle up in catalog by puzzle_id,
+   * since the due puzzles are far fewer than a full catalog, so the index on
+   * rating was never used and only slowed catalog import */
+  "drop index if exists catalog_rating_idx;",
+};
+/* algorithm_names are the names reschedule accepts, indexed by the
+ * ALGORITHM_ constants */
+char const *algorithm_names[] = { "fibonacci", "sm2" };
 char const *dtformat = "%F";
 char const *success_fail_string_regex = "^[sf]+$";
 char const *useage = 
@@ -43,13 +173,88 @@ char const *useage =
   " \"s\" -- marks the current puzzle for success\n"
   " \"f\" -- marks the current puzzle for success\n"
   " \"delete <puzzle__id>\" -- removes all references to puzzle <puzzle_id> from the database\n"
-  " \"future\" -- prints a list of dates paired with the number of tests schedules for that date\n"
+  " \"future\" -- prints the number of overdue tests and a list of dates from today on paired with the number of tests scheduled for that date\n"
   " \"next\" -- prints the next puzzle for the day, if available\n"
   " \"n <number>\" -- prints the next n puzzles for the day, if so many are available\n"
+  " \"sync <other.sqlite>\" -- exchanges the results each database has not seen from the other and reschedules the puzzles they touch\n"
+  " \"snapshot <dest>\" -- copies the database to <dest> without blocking other commands, rewriting only the pages that changed since the last snapshot\n"
+  " \"maintain <dir> [--jobs <n>] [--pages <n>] [--pause <ms>] [--quick]\" -- migrates, checks, analyzes and reclaims free space in every .sqlite file under <dir> with <n> threads\n"
+  " \"metrics [--json]\" -- prints command counts, latency histograms, database open time, rows touched and results per day in Prometheus text format or as JSON\n"
   " \"stats\" -- prints the overall success and failure rates\n"
   " \"daystats <day>\" -- prints a breakdown of the score distribution for the tests scheduled for the day given\n"
+  " \"plan --budget <n> [--dry-run]\" -- caps every day from today at <n> tests, deferring the overflow to the following days in --order priority\n"
+  " \"rebuild\" -- recomputes every puzzle's score and next test date by replaying the results log\n"
+  " \"rebuild --check\" -- replays the results log and reports differences without saving them\n"
+  " \"reschedule --algorithm <fibonacci|sm2> [--dry-run]\" -- recomputes every puzzle's next test date from its history under a new interval algorithm\n"
+  " \"shuffle --seed <n>\" -- reshuffles the order puzzles are handed out in with --order random, using the seed <n>\n"
+  " \"catalog import <file>\" -- loads puzzle ratings and themes from a CSV or NDJSON file for use with --theme and --rating\n"
   " \"useage\" -- prints this message\n"
-  " if command is none of these it should be a puzzle number (or url) followed by the character 's' or 'f' indicating success or failure\n";
+  " \"watch\" -- keeps running and prints the number of tests remaining today whenever it changes, waking only when the next test falls due or the database changes\n"
+  " if command is none of these it should be a puzzle number (or url) followed by the character 's' or 'f' indicating success or failure\n"
+  "OPTIONS\n"
+  " \"--as-of <day>\" -- treats <day> (YYYY-MM-DD) as today for any command\n"
+  " \"--sandbox\" -- runs against an in-memory copy of the database that is never saved; with no command, reads commands from stdin one per line\n"
+  " \"--order overdue|score|random\" -- the order puzzles due today are worked in: most overdue first (the default), lowest score first or a fixed shuffle (see shuffle)\n"
+  " \"--theme <theme>\" -- only hands out puzzles the catalog lists with <theme>\n"
+  " \"--rating <min>[-<max>]\" -- only hands out puzzles the catalog rates between <min> and <max>\n";
+
+/* metrics_command_names are the commands metrics are kept for, in the order
+ * of their slots in the metrics file - only ever append to this list.  advance
+ * is a, batch is a string of results (including a lone s or f) and result is
+ * a puzzle id followed by s or f */
+char const *metrics_command_names[METRICS_COMMANDS] = {
+  "next", "n", "advance", "batch", "result", "stats", "daystats", "future", "delete", "watch",
+  "rebuild", "catalog", "reschedule", "plan", "sync", "snapshot", "metrics", "useage", "maintain",
+  "shuffle"
+};
+
+/* metrics_bucket_bounds_us are the upper bounds in microseconds of the
+ * latency histogram buckets, with one more bucket after them for anything
+ * slower */
+long metrics_bucket_bounds_us[METRICS_BUCKETS] = {
+  1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 10000000
+};
+
+/* metrics is the shared metrics file mapped by open_metrics, or NULL if no
+ * metrics are being recorded, and metrics_command is the index of the command
+ * being run.  pending_results counts the results logged by the open write
+ * transaction, which are only counted once it commits */
+struct metrics_data * metrics = NULL;
+int metrics_command = -1;
+int pending_results = 0;
+
+/* db_busy_timeout_ms is how long get_db_conn's connection waits for another
+ * process to release a lock, and spool_consumed how much of the spool file
+ * the open write transaction has recorded */
+int db_busy_timeout_ms = DB_BUSY_TIMEOUT_MS;
+long spool_consumed = 0;
+char spool_first_line[MAX_SPOOL_LINE] = "";
+
+/* write_report holds what the open write transaction reports about the
+ * results it records, shown by commit_write only once they are saved */
+FILE * write_report = NULL;
+char * write_report_buffer = NULL;
+size_t write_report_len = 0;
+
+/* as_of_day holds the day given with --as-of, if any, which replaces the system
+ * clock's notion of today */
+char as_of_day[11] = "";
+
+/* queue_order holds the order given with --order in which the puzzles due
+ * today are handed out */
+char queue_order[10] = "overdue";
+
+/* queue_theme, queue_min_rating and queue_max_rating hold the --theme and
+ * --rating filters on the queue.  An empty theme or a min rating of -1 means
+ * no filter */
+char queue_theme[MAX_THEME_LEN] = "";
+int queue_min_rating = -1;
+int queue_max_rating = INT_MAX;
+
+/* sandbox_mode is set by --sandbox, which runs commands against an in-memory
+ * copy of the database held open in sandbox_dbc */
+int sandbox_mode = 0;
+sqlite3 * sandbox_dbc = NULL;
 
 mode_t fullmode = S_IRWXU|S_IRWXG|S_IRWXO;
 
@@ -81,6 +286,9 @@ void create_tables(sqlite3* dbc) {
   char * error_message = 0;
   int rc;
 
+  // Must precede the first table; lets maintain hand free pages back a few at a time
+  sqlite3_exec(dbc, set_incremental_vacuum_statement, NULL, NULL, NULL);
+
   rc = sqlite3_exec(dbc, create_puzzles_table, NULL, NULL, &error_message);
   if (error_message != 0) {
     printf("%s\n", error_message);
@@ -95,23 +303,228 @@ void create_tables(sqlite3* dbc) {
 
 }
 
+/* migrate_schema takes an sqlite3 database connection and applies any entries
+ * of schema_migrations the database has not seen yet, recording the new
+ * version in user_version.  Each migration runs in its own immediate
+ * transaction and user_version is read again once the lock is held, so when
+ * several processes find the schema behind each migration is applied once.
+ * Returns true if the schema is then up to date.  If it is not, the reason is
+ * copied into error, or printed if error is NULL */
+int migrate_schema(sqlite3* dbc, char * error, int error_len) {
+  char * error_message = 0;
+  int target = sizeof(schema_migrations) / sizeof(schema_migrations[0]);
+  int version = read_schema_version(dbc);
+
+  while(version >= 0 && version < target){
+    char set_version[40];
+    sprintf(set_version, "pragma user_version=%d", version + 1);
+
+    if(sqlite3_exec(dbc, begin_immediate_statement, NULL, NULL, NULL) != SQLITE_OK){
+      version = -1;
+      break;
+    }
+    int locked_version = read_schema_version(dbc);
+    if(locked_version != version){ // another process migrated it first
+      sqlite3_exec(dbc, rollback_transaction_statememt, NULL, NULL, NULL);
+      version = locked_version;
+      continue;
+    }
+
+    sqlite3_exec(dbc, schema_migrations[version], NULL, NULL, &error_message);
+    if(error_message == 0){
+      sqlite3_exec(dbc, set_version, NULL, NULL, NULL);
+      if(sqlite3_exec(dbc, commit_transaction_statement, NULL, NULL, NULL) != SQLITE_OK){
+        error_message = sqlite3_mprintf("%s", sqlite3_errmsg(dbc));
+      }
+    }
+    if (error_message != 0) {
+      if(error != NULL){
+        snprintf(error, error_len, "migrating schema to version %d failed: %s", version + 1, error_message);
+      } else {
+        printf("ERROR migrating schema to version %d: %s\n", version + 1, error_message);
+      }
+      sqlite3_free(error_message);
+      sqlite3_exec(dbc, rollback_transaction_statememt, NULL, NULL, NULL);
+      return 0;
+    }
+    version++;
+  }
+
+  if(version < 0){ // locked - try next time
+    if(error != NULL){
+      snprintf(error, error_len, "cannot read schema version: %s", sqlite3_errmsg(dbc));
+    }
+    return 0;
+  }
+
+  return 1;
+}
+
+/* read_schema_version returns the database's user_version, or -1 if it cannot
+ * be read */
+int read_schema_version(sqlite3 * dbc) {
+
+  sqlite3_stmt * version_stmt;
+  int version = -1;
+
+  if(sqlite3_prepare_v2(dbc, get_schema_version_statement, strlen(get_schema_version_statement), &version_stmt, NULL) == SQLITE_OK && sqlite3_step(version_stmt) == SQLITE_ROW){
+    version = sqlite3_column_int(version_stmt, 0);
+  }
+  sqlite3_finalize(version_stmt);
+
+  return version;
+
+}
+
+/* schema_is_current returns true if the database has had every entry of
+ * schema_migrations applied */
+int schema_is_current(sqlite3 * dbc) {
+
+  int target = sizeof(schema_migrations) / sizeof(schema_migrations[0]);
+
+  return get_pragma_int(dbc, get_schema_version_statement) >= target;
+
+}
+
+/* open_database takes the path of an existing database file and returns a
+ * connection to it with the schema migrated, or NULL if it cannot be opened,
+ * holds no results table or cannot be migrated, with the reason copied into
+ * error */
+sqlite3* open_database(const char * path, char * error, int error_len) {
+
+  sqlite3* dbc = 0;
+  sqlite3_stmt * check_stmt;
+
+  if(sqlite3_open_v2(path, &dbc, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK){
+    snprintf(error, error_len, "cannot be opened: %s", sqlite3_errmsg(dbc));
+    sqlite3_close(dbc);
+    return NULL;
+  }
+  sqlite3_busy_timeout(dbc, DB_BUSY_TIMEOUT_MS);
+
+  char * check_statement = sqlite3_mprintf(check_results_table_statement, "main");
+  sqlite3_prepare_v2(dbc, check_statement, -1, &check_stmt, NULL);
+  sqlite3_free(check_statement);
+  int result = sqlite3_step(check_stmt);
+  int has_results = result == SQLITE_ROW && sqlite3_column_int(check_stmt, 0) > 0;
+  if(result != SQLITE_ROW){
+    snprintf(error, error_len, "cannot be read: %s", sqlite3_errmsg(dbc));
+  } else if(!has_results) {
+    snprintf(error, error_len, "is not a puzzle database");
+  }
+  sqlite3_finalize(check_stmt);
+  if(!has_results){
+    sqlite3_close(dbc);
+    return NULL;
+  }
+
+  if(!migrate_schema(dbc, error, error_len)){
+    sqlite3_close(dbc);
+    return NULL;
+  }
+
+  return dbc;
+
+}
+
+/* get_sandbox_conn returns the connection to the in-memory copy of the
+ * database used in --sandbox mode, loading it with the backup API on first
+ * use.  The file is only ever opened read-only, so nothing done in the
+ * sandbox is written back.  Returns NULL if the sandbox cannot be loaded */
+sqlite3* get_sandbox_conn() {
+
+  if(sandbox_dbc != NULL){
+    return sandbox_dbc;
+  }
+
+  if(sqlite3_open_v2(sandbox_uri, &sandbox_dbc, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL) != SQLITE_OK){
+    printf("ERROR opening sandbox: %s\n", sqlite3_errmsg(sandbox_dbc));
+    sqlite3_close(sandbox_dbc);
+    sandbox_dbc = NULL;
+    return NULL;
+  }
+
+  if(database_file_exists()){
+    sqlite3 * file_dbc = 0;
+    int result = sqlite3_open_v2(dbfh, &file_dbc, SQLITE_OPEN_READONLY, NULL);
+    if(result != SQLITE_OK){
+      printf("ERROR loading sandbox from %s: %s\n", dbfh, sqlite3_errmsg(file_dbc));
+    } else {
+      sqlite3_backup * backup = sqlite3_backup_init(sandbox_dbc, "main", file_dbc, "main");
+      result = backup == NULL ? sqlite3_errcode(sandbox_dbc) : sqlite3_backup_step(backup, -1);
+      sqlite3_backup_finish(backup);
+      if(result != SQLITE_DONE){
+        printf("ERROR loading sandbox from %s: %s\n", dbfh, backup == NULL ? sqlite3_errmsg(sandbox_dbc) : sqlite3_errstr(result));
+      }
+    }
+    sqlite3_close(file_dbc);
+    if(result != SQLITE_DONE){
+      sqlite3_close(sandbox_dbc);
+      sandbox_dbc = NULL;
+      return NULL;
+    }
+  } else {
+    create_tables(sandbox_dbc);
+  }
+
+  migrate_schema(sandbox_dbc, NULL, 0);
+
+  return sandbox_dbc;
+
+}
+
+/* get_database_path returns what to open for another connection to the
+ * current database - the file itself, or the in-memory copy in --sandbox
+ * mode (which must be opened with SQLITE_OPEN_URI) */
+const char * get_database_path() {
+  return sandbox_mode ? sandbox_uri : dbfh;
+}
+
+/* release_db_conn closes a connection returned by get_db_conn.  The sandbox
+ * connection is kept open, since closing it would discard the sandbox */
+void release_db_conn(sqlite3 * dbc) {
+
+  if(dbc == sandbox_dbc){
+    return;
+  }
+
+  struct change_count * changes = sqlite3_rollback_hook(dbc, NULL, NULL);
+  if(changes != NULL){
+    record_rows_touched(changes->committed);
+    free(changes);
+  }
+  sqlite3_close(dbc);
+
+}
+
 /* get_db_conn() returns an sqlite3 database connection to an sqlite3  database
  * file called dailypuzzles.sqlite in the same directory as the current script,
- * creating it if it does not exist. */
+ * creating it if it does not exist.  In --sandbox mode it returns the sandbox,
+ * which main loads before running any command. */
 sqlite3* get_db_conn() {
 
+  if(sandbox_mode){
+    return get_sandbox_conn();
+  }
+
   sqlite3* dbc = 0;
   int errnum;
   int db_exists = database_file_exists();
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
   if (!db_exists) {
     touch_dbfile();
   }
 
   sqlite3_open(dbfh, &dbc);
+  sqlite3_busy_timeout(dbc, db_busy_timeout_ms);
   if (!db_exists){ //create table if file wasnt there
     create_tables(dbc);
   }
+  migrate_schema(dbc, NULL, 0);
+  record_db_open_metric(get_elapsed_us(&start));
+  count_changes(dbc);
 
   return dbc;
 
@@ -134,12 +547,6 @@ int fibonacci1(int seed) {
   return b;
 }
 
-struct interval_update {
-  int successes;
-  double easiness_factor;
-  int interval;
-};
-
 /* Implementaton of the SM2 algoriithm from SuperMemo: n - number of successful
  * repetitions in a row q - user grade for how difficult recall was - (>= 3
  * indiicates success) RETURNS - interval in days before next test
@@ -177,6 +584,14 @@ struct tm* get_current_time() {
 
   time_t currtm = time(NULL);
   struct tm * lcltm = localtime(&currtm);
+
+  if(strlen(as_of_day) > 0){ //--as-of replaces the calendar day but keeps the clock
+    sscanf(as_of_day, "%d-%d-%d", &lcltm->tm_year, &lcltm->tm_mon, &lcltm->tm_mday);
+    lcltm->tm_year -= 1900;
+    lcltm->tm_mon -= 1;
+    lcltm->tm_isdst = -1;
+  }
+
   return lcltm;
 
 }
@@ -204,6 +619,50 @@ void get_today(char * repr) {
 
 }
 
+/* is_valid_day checks whether a string is a day in YYYY-MM-DD format */
+int is_valid_day(const char * day) {
+  int year, month, mday;
+  char trailing;
+
+  if(strlen(day) != 10 || sscanf(day, "%4d-%2d-%2d%c", &year, &month, &mday, &trailing) != 3){
+    return 0;
+  }
+
+  return month >= 1 && month <= 12 && mday >= 1 && mday <= 31;
+}
+
+/* day_number takes a day in YYYY-MM-DD format and returns the number of days
+ * since 1970-01-01.  Replaying the results log does its date arithmetic on
+ * these instead of going through mktime for every row */
+int day_number(const char * day) {
+  int year, month, mday;
+  sscanf(day, "%d-%d-%d", &year, &month, &mday);
+
+  year -= month <= 2;
+  int era = (year >= 0 ? year : year - 399) / 400;
+  int year_of_era = year - era * 400;
+  int day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + mday - 1;
+  int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+  return era * 146097 + day_of_era - 719468;
+}
+
+/* day_from_number is the inverse of day_number and writes the day <days> days
+ * after 1970-01-01 to repr in YYYY-MM-DD format */
+void day_from_number(char * repr, int days) {
+  days += 719468;
+  int era = (days >= 0 ? days : days - 146096) / 146097;
+  int day_of_era = days - era * 146097;
+  int year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+  int day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  int mp = (5 * day_of_year + 2) / 153;
+  int mday = day_of_year - (153 * mp + 2) / 5 + 1;
+  int month = mp < 10 ? mp + 3 : mp - 9;
+  int year = year_of_era + era * 400 + (month <= 2);
+
+  sprintf(repr, "%04d-%02d-%02d", year, month, mday);
+}
+
 /* print instructions on how to use this program */
 void print_useage() {
   puts(useage);
@@ -241,12 +700,19 @@ void get_stats(sqlite3* dbc, char * buffer) {
 
 /* get_total_tests_for_day takes a database connection and a string
  * representation of a day in YYYY-MM-DD format and returns the total number of
- * tests slated to be worked on that day */
+ * tests slated to be worked on or before that day, summed from the due_counts
+ * histogram.  When the queue is filtered with --theme or --rating the due
+ * puzzles are counted against the catalog instead */
 int get_total_tests_for_day(sqlite3 *dbc, char * day) {
 
   sqlite3_stmt * total_test_stmt;
 
-  sqlite3_prepare_v2(dbc, get_total_remaining_tests_statement, strlen(get_total_remaining_tests_statement), &total_test_stmt, NULL);
+  if(queue_is_filtered()){
+    sqlite3_prepare_v2(dbc, get_total_remaining_filtered_tests_statement, strlen(get_total_remaining_filtered_tests_statement), &total_test_stmt, NULL);
+    bind_queue_filters(total_test_stmt, 2);
+  } else {
+    sqlite3_prepare_v2(dbc, get_total_remaining_tests_statement, strlen(get_total_remaining_tests_statement), &total_test_stmt, NULL);
+  }
 
   sqlite3_bind_text(total_test_stmt,1,day,strlen(day),NULL);
 
@@ -254,67 +720,90 @@ int get_total_tests_for_day(sqlite3 *dbc, char * day) {
 
   if(result == SQLITE_ERROR){
     printf("ERROR getting test count: %s\n", sqlite3_errmsg(dbc));
+    sqlite3_finalize(total_test_stmt);
     return 0;
   }
 
   if(result == SQLITE_ROW){
     int total_tests = sqlite3_column_int(total_test_stmt, 0);
+    sqlite3_finalize(total_test_stmt);
     return total_tests;
   }
 
   printf("ERROR getting test count\n");
+  sqlite3_finalize(total_test_stmt);
 
   return 0;
 
 }
 
 /* current_puzzle takes a database connection and returns the puzzle_id of the
- * next  puzzle to be worked today */
+ * next  puzzle to be worked today, which is the head of the queue */
 void current_puzzle(sqlite3* dbc, char * retval) {
 
-  sqlite3_stmt * next_test_stmt;
   char today[11];
   get_today(today);
 
-  sqlite3_prepare_v2(dbc, get_next_test_statement, strlen(get_next_test_statement) + 50, &next_test_stmt, NULL);
+  get_puzzle_at_offset(dbc, retval, 0, today);
 
-  sqlite3_bind_text(next_test_stmt,1,today,strlen(today),NULL);
+}
 
-  int result = sqlite3_step(next_test_stmt);
+/* get_queue_statement returns the statement that selects the puzzle at a given
+ * offset in the queue for the order chosen with --order */
+const char * get_queue_statement() {
 
-  if(result == SQLITE_ERROR){
-    printf("ERROR getting next test: %s\n", sqlite3_errmsg(dbc));
-    strcpy(retval, "\0"); 
-    return;
+  if(strcmp(queue_order, "score") == 0){
+    return get_puzzle_at_offset_score_statement;
   }
 
-  if(result == SQLITE_ROW) {
-    const unsigned char* next_test_id = sqlite3_column_text(next_test_stmt,0);
+  if(strcmp(queue_order, "random") == 0){
+    return get_puzzle_at_offset_random_statement;
+  }
 
+  return get_puzzle_at_offset_overdue_statement;
 
-    strcpy(retval, next_test_id);
-    sqlite3_finalize(next_test_stmt);
-    return;
+}
+
+/* queue_is_filtered returns true if --theme or --rating narrowed the queue */
+int queue_is_filtered() {
+  return strlen(queue_theme) > 0 || queue_min_rating >= 0;
+}
+
+/* bind_queue_filters binds the --theme and --rating filters to the three
+ * parameters of a queue statement starting at <first>, leaving them null when
+ * the filter was not given */
+void bind_queue_filters(sqlite3_stmt * stmt, int first) {
+
+  if(strlen(queue_theme) > 0){
+    sqlite3_bind_text(stmt,first,queue_theme,strlen(queue_theme),NULL);
+  } else {
+    sqlite3_bind_null(stmt,first);
   }
 
-  // There are no more tests, return empty string.  Shouldn't actually get here
-  // if you call get_total_tests_for_day and verify it's greater than 0 first
-  strcpy(retval, "\0"); 
-  sqlite3_finalize(next_test_stmt);
+  if(queue_min_rating >= 0){
+    sqlite3_bind_int(stmt,first + 1,queue_min_rating);
+    sqlite3_bind_int(stmt,first + 2,queue_max_rating);
+  } else {
+    sqlite3_bind_null(stmt,first + 1);
+    sqlite3_bind_null(stmt,first + 2);
+  }
 
 }
 
 /* get_puzzle_at_offset takes a database connection, and integer offset and a
  * representation of a day in YYYY-MM-DD format and returns the puzzle at
- * <offset> position in line to be worked on that day */
+ * <offset> position in line to be worked on that day, in the order chosen
+ * with --order */
 void get_puzzle_at_offset(sqlite3 * dbc, char * retval, int offset, char * day) {
 
   sqlite3_stmt * get_puzzle_at_offset_stmt;
+  const char * queue_statement = get_queue_statement();
 
-  sqlite3_prepare_v2(dbc, get_puzzle_at_offset_statement, strlen(get_puzzle_at_offset_statement) + 50, &get_puzzle_at_offset_stmt, NULL);
+  sqlite3_prepare_v2(dbc, queue_statement, strlen(queue_statement), &get_puzzle_at_offset_stmt, NULL);
 
   sqlite3_bind_text(get_puzzle_at_offset_stmt,1,day,strlen(day),NULL);
-  sqlite3_bind_int(get_puzzle_at_offset_stmt,2,offset);
+  bind_queue_filters(get_puzzle_at_offset_stmt, 2);
+  sqlite3_bind_int(get_puzzle_at_offset_stmt,5,offset);
 
   int result = sqlite3_step(get_puzzle_at_offset_stmt);
   if(result == SQLITE_ROW){
@@ -348,10 +837,9 @@ void get_next() {
       return;
     }
 
-    int current_score = get_score_for_puzzle(dbc, next_test_id) + 1;
-    int day_offset = fibonacci1(current_score);
+    int current_score;
     char next_test_day[11];
-    get_target_day(next_test_day, day_offset);
+    get_next_test_on_success(dbc, next_test_id, &current_score, next_test_day);
 
     char stats[STATS_LEN];
     get_stats(dbc, stats);
@@ -398,7 +886,7 @@ void get_next_count(int count) {
 
   }
 
-  sqlite3_close(dbc);
+  release_db_conn(dbc);
 
 }
 
@@ -423,27 +911,56 @@ int check_success_string_arg(char * success_arg){
  * puzzles to match the string */
 void record_batch_results(char * success_arg) {
 
-  sqlite3 * dbc = get_db_conn();
+  sqlite3 * dbc = get_recording_conn();
 
   char today[11];
   get_today(today);
   int batch_count = strlen(success_arg);
+
+  // Hold the write lock from reading the queue until the results are in, so a
+  // concurrent batch cannot pick the same puzzles off the queue
+  if(begin_write(dbc) != SQLITE_OK){
+    spool_results("-", success_arg);
+    release_db_conn(dbc);
+    return;
+  }
   int tests_remaining = get_total_tests_for_day(dbc, today);
 
   if(batch_count > tests_remaining) {
     printf("Cannot batch record results - there are only %d tests remaining and there are %d items in the request.\n", tests_remaining, batch_count);
+    commit_write(dbc);
+    release_db_conn(dbc);
     return;
   }
 
+  // Read the whole batch off the queue before recording anything, since each
+  // result moves its puzzle out of today's queue and shifts the offsets
+  char (*puzzle_ids)[MAX_PUZZLE_LEN] = malloc(sizeof(*puzzle_ids) * batch_count);
+  if(puzzle_ids == NULL){
+    printf("ERROR recording batch: out of memory for %d results\n", batch_count);
+    commit_write(dbc);
+    release_db_conn(dbc);
+    return;
+  }
   for(int i = 0; i < batch_count; i++) {
+    get_puzzle_at_offset(dbc,puzzle_ids[i],i,today);
+  }
+
+  int result = SQLITE_OK;
+  for(int i = 0; i < batch_count && result == SQLITE_OK; i++) {
     char s_arg[2];
-    char puzzle_id_arg[MAX_PUZZLE_LEN];
     sprintf(s_arg, "%c", success_arg[i]);
-    get_puzzle_at_offset(dbc,puzzle_id_arg,i,today);
-    update_existing_puzzle(dbc, puzzle_id_arg, s_arg);
+    result = update_existing_puzzle(dbc, puzzle_ids[i], s_arg);
+  }
+  if(result != SQLITE_OK){
+    rollback_write(dbc);
+  } else if(commit_write(dbc) != SQLITE_OK){
+    spool_results("-", success_arg);
   }
 
-  sqlite3_close(dbc);
+  free(puzzle_ids);
+
+  release_db_conn(dbc);
 
 }
 
@@ -473,14 +990,15 @@ int check_puzzle_exists(sqlite3* dbc, char * puzzle_id) {
   sqlite3_prepare_v2(dbc, puzzle_exists_statement, 50, &stmt, NULL);
   sqlite3_bind_text(stmt,1,puzzle_id,strlen(puzzle_id),NULL);
   int result = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
   return result == SQLITE_ROW;
 }
 
 /* reset_puzzle_for_failure takes a database connection and a string
  * representing a puzzle id and sets the score for that puzzle to 0 and the
  * next test day to tomorrow, effectively starting the process for that puzzle
- * over */
-void reset_puzzle_for_failure(sqlite3* dbc, char * puzzle_id_arg) {
+ * over.  Returns SQLITE_OK, or the error that stopped it */
+int reset_puzzle_for_failure(sqlite3* dbc, char * puzzle_id_arg) {
 
   char puzzle_id[MAX_PUZZLE_LEN];
   strcpy(puzzle_id, puzzle_id_arg); //Copy in because otherwise there's weird behavior after finalize, I think???
@@ -503,6 +1021,8 @@ void reset_puzzle_for_failure(sqlite3* dbc, char * puzzle_id_arg) {
 
   sqlite3_finalize(update_puzzle_stmt);
 
+  return result == SQLITE_DONE ? SQLITE_OK : result;
+
 }
 
 /* get_next_test_day_for_puzzle takes a database connection and a string
@@ -535,7 +1055,7 @@ void get_next_test_day_for_puzzle(sqlite3 * dbc, char * day_output, char * puzzl
  * represents an input to an algorithm to determine how many days in the future
  * to work the puzzle again. */
 int get_score_for_puzzle(sqlite3 * dbc, char * puzzle_id){
-  printf("GET SCORE FOR: %s\n", puzzle_id);
+  fprintf(get_report_stream(), "GET SCORE FOR: %s\n", puzzle_id);
 
   sqlite3_stmt * get_score_stmt;
   int score = 0;
@@ -564,18 +1084,18 @@ int get_score_for_puzzle(sqlite3 * dbc, char * puzzle_id){
 
 /* advance_puzzle_on_success takes a database connection and a puzzle id,
  * increments the score for that puzzle, calculates -  based on the updated
- * score - what the next test day should be and then saves this in the database
- * */
-void advance_puzzle_on_success(sqlite3* dbc, char * puzzle_id_arg) {
+ * score and the deck's interval algorithm - what the next test day should be
+ * and then saves this in the database.  Returns SQLITE_OK, or the error that
+ * stopped it */
+int advance_puzzle_on_success(sqlite3* dbc, char * puzzle_id_arg) {
 
   char puzzle_id[MAX_PUZZLE_LEN];
   strcpy(puzzle_id, puzzle_id_arg);// copy puzzle_id because otherwise it drops after sqlite3_finalize - I think???
 
   sqlite3_stmt * update_puzzle_stmt;
-  int current_score = get_score_for_puzzle(dbc, puzzle_id) + 1;
-  int day_offset = fibonacci1(current_score);
+  int current_score;
   char next_test_day[11];
-  get_target_day(next_test_day, day_offset);
+  get_next_test_on_success(dbc, puzzle_id, &current_score, next_test_day);
 
   sqlite3_prepare_v2(dbc, update_puzzle_statement, strlen(update_puzzle_statement) + 20, &update_puzzle_stmt, NULL);
 
@@ -590,12 +1110,14 @@ void advance_puzzle_on_success(sqlite3* dbc, char * puzzle_id_arg) {
 
   sqlite3_finalize(update_puzzle_stmt);
 
+  return result == SQLITE_DONE ? SQLITE_OK : result;
+
 }
 
 /* log_result takes a database connection, a string representing a puzzle id
  * and a string indicating success or failure and logs this result in the
- * database */
-void log_result(sqlite3 *dbc, char * puzzle_id, char * success_arg) {
+ * database.  Returns SQLITE_OK, or the error that stopped it */
+int log_result(sqlite3 *dbc, char * puzzle_id, char * success_arg) {
 
   sqlite3_stmt * insert_result_stmt;
   char today[11];
@@ -610,39 +1132,60 @@ void log_result(sqlite3 *dbc, char * puzzle_id, char * success_arg) {
   int result = sqlite3_step(insert_result_stmt);
   if(result == SQLITE_ERROR || result != SQLITE_DONE){
     printf("ERROR inserting new puzzle result: %s\n", sqlite3_errmsg(dbc));
+  } else {
+    pending_results++;
   }
   sqlite3_finalize(insert_result_stmt);
+
+  return result == SQLITE_DONE ? SQLITE_OK : result;
 }
 
 /* update_existing_puzzle takes a database connection, a string representing a
  * puzzle id and a string representing success or failure, logs this result for
  * the puzzle in the database and then calculates and stores the next day the
- * puzzle should be run */
-void update_existing_puzzle(sqlite3* dbc, char * puzzle_id, char * success_arg) {
+ * puzzle should be run.  Returns SQLITE_OK, or the error that stopped it */
+int update_existing_puzzle(sqlite3* dbc, char * puzzle_id, char * success_arg) {
 
   char stats[STATS_LEN];
+  FILE * report = get_report_stream();
+  int result;
 
   if(is_fail(success_arg)){
-    reset_puzzle_for_failure(dbc, puzzle_id);
-    log_result(dbc, puzzle_id, success_arg);
-    printf("Puzzle %s reset for failure\n", puzzle_id);
+    result = reset_puzzle_for_failure(dbc, puzzle_id);
+    if(result == SQLITE_OK){
+      result = log_result(dbc, puzzle_id, success_arg);
+    }
+    if(result != SQLITE_OK){
+      return result;
+    }
+    fprintf(report, "Puzzle %s reset for failure\n", puzzle_id);
     get_stats(dbc, stats);
-    puts(stats);
+    fprintf(report, "%s\n", stats);
   } else {
-    advance_puzzle_on_success(dbc, puzzle_id);
-    log_result(dbc, puzzle_id, success_arg);
+    result = advance_puzzle_on_success(dbc, puzzle_id);
+    if(result == SQLITE_OK){
+      result = log_result(dbc, puzzle_id, success_arg);
+    }
+    if(result != SQLITE_OK){
+      return result;
+    }
     char next_test_day[11];
     get_next_test_day_for_puzzle(dbc, next_test_day, puzzle_id);
-    printf("Puzzle %s incremented for success\n", puzzle_id);
-    printf("NEXT TEST DATE: %s\n", next_test_day);
+    fprintf(report, "Puzzle %s incremented for success\n", puzzle_id);
+    fprintf(report, "NEXT TEST DATE: %s\n", next_test_day);
     get_stats(dbc, stats);
-    puts(stats);
-  } 
+    fprintf(report, "%s\n", stats);
+  }
 
+  return SQLITE_OK;
 
 }
 
-void create_new_puzzle_entry(sqlite3* dbc, char * puzzle_id, char * success_arg) {
+/* create_new_puzzle_entry takes a database connection, a string representing a
+ * puzzle id and a string representing success or failure, adds the puzzle due
+ * tomorrow and logs the result.  Returns SQLITE_OK, or the error that stopped
+ * it */
+int create_new_puzzle_entry(sqlite3* dbc, char * puzzle_id, char * success_arg) {
 
   sqlite3_stmt * insert_puzzle_stmt;
 
@@ -661,7 +1204,11 @@ void create_new_puzzle_entry(sqlite3* dbc, char * puzzle_id, char * success_arg)
   }
   sqlite3_finalize(insert_puzzle_stmt);
 
-  log_result(dbc, puzzle_id, success_arg);
+  if(result != SQLITE_DONE){
+    return result;
+  }
+
+  return log_result(dbc, puzzle_id, success_arg);
 
 }
 
@@ -671,16 +1218,24 @@ void create_new_puzzle_entry(sqlite3* dbc, char * puzzle_id, char * success_arg)
  * database or not */
 void update_puzzle(char * puzzle_id, char * success_arg) {
 
-  sqlite3* dbc = get_db_conn();
+  sqlite3* dbc = get_recording_conn();
+
+  if(begin_write(dbc) != SQLITE_OK){
+    spool_results(puzzle_id, success_arg);
+    release_db_conn(dbc);
+    return;
+  }
 
   int exists = check_puzzle_exists(dbc, puzzle_id);
-  if(exists){
-    update_existing_puzzle(dbc, puzzle_id, success_arg);
-  } else {
-    create_new_puzzle_entry(dbc, puzzle_id, success_arg);
+  int result = exists ? update_existing_puzzle(dbc, puzzle_id, success_arg) : create_new_puzzle_entry(dbc, puzzle_id, success_arg);
+
+  if(result != SQLITE_OK){
+    rollback_write(dbc);
+  } else if(commit_write(dbc) != SQLITE_OK){
+    spool_results(puzzle_id, success_arg);
   }
 
-  sqlite3_close(dbc);
+  release_db_conn(dbc);
 
 }
 
@@ -691,7 +1246,7 @@ void show_stats() {
   char stats[STATS_LEN];
   get_stats(dbc, stats);
   puts(stats);
-  sqlite3_close(dbc);
+  release_db_conn(dbc);
 
 }
 
@@ -700,11 +1255,20 @@ void show_stats() {
  * according to the success argument  */
 void mark_current_puzzle(char * success_arg) {
 
-  sqlite3 * dbc = get_db_conn();
+  sqlite3 * dbc = get_recording_conn();
   char puzzle_id[MAX_PUZZLE_LEN];
+  if(begin_write(dbc) != SQLITE_OK){
+    spool_results("-", success_arg);
+    release_db_conn(dbc);
+    return;
+  }
   current_puzzle(dbc, puzzle_id);
-  update_existing_puzzle(dbc, puzzle_id, success_arg);
-  sqlite3_close(dbc);
+  if(update_existing_puzzle(dbc, puzzle_id, success_arg) != SQLITE_OK){
+    rollback_write(dbc);
+  } else if(commit_write(dbc) != SQLITE_OK){
+    spool_results("-", success_arg);
+  }
+  release_db_conn(dbc);
 
 }
 
@@ -727,9 +1291,6 @@ void set_puzzle_date(sqlite3 * dbc, char * puzzle_id, char * target_day) {
   }
   sqlite3_finalize(set_date_stmt);
 
-
-  sqlite3_close(dbc);
-
 }
 
 /* advance_current_puzzle takes an int <days> and advances the next puzzle to
@@ -742,6 +1303,7 @@ void advance_current_puzzle(int days) {
   char target_day[11];
   get_target_day(target_day, days);
   set_puzzle_date(dbc, puzzle_id, target_day);
+  release_db_conn(dbc);
 
 }
 
@@ -761,115 +1323,3026 @@ void get_puzzle_id(char * buffer, char * command_arg){
   buffer[i] = '\0';
 }
 
-/* delete_puzzle takes a puzzle_id and creates a database connecton which it
- * uses to delete the puzzle from the database completely, including records of
- * results */
-void delete_puzzle(char * puzzle_id) {
-  sqlite3 * dbc = get_db_conn();
-  sqlite3_stmt * delete_puzzle_stmt;
-  sqlite3_stmt * delete_puzzle_results_stmt;
-  sqlite3_prepare_v2(dbc, delete_puzzle_from_puzzles_statement, strlen(delete_puzzle_from_puzzles_statement), &delete_puzzle_stmt, NULL);
-  sqlite3_prepare_v2(dbc, delete_puzzle_from_results_statement, strlen(delete_puzzle_from_results_statement), &delete_puzzle_results_stmt, NULL);
+/* spool_pending returns true if the spool file holds results waiting to be
+ * recorded.  The spool is never touched in --sandbox mode */
+int spool_pending() {
 
-  sqlite3_bind_text(delete_puzzle_stmt,1,puzzle_id,strlen(puzzle_id),NULL);
-  sqlite3_bind_text(delete_puzzle_results_stmt,1,puzzle_id,strlen(puzzle_id),NULL);
+  struct stat st;
 
+  return !sandbox_mode && stat(spool_file, &st) == 0 && st.st_size > 0;
 
-  sqlite3_exec(dbc, begin_transaction_statement, NULL, NULL, NULL);
-  int result = sqlite3_step(delete_puzzle_stmt);
-  if(result == SQLITE_ERROR) {
-    printf("ERROR deleting puzzle: %s\n", sqlite3_errmsg(dbc));
-    sqlite3_exec(dbc, rollback_transaction_statememt, NULL, NULL, NULL);
+}
+
+/* spool_results appends one result per character of success_arg for
+ * puzzle_id - or for the puzzle due first, if puzzle_id is "-" - to the spool
+ * file, to be recorded by the next command that can reach the database.  All
+ * the entries go in one append-only write that is synced before returning, so
+ * a crash loses at most the entry being written.  Each line is "<key> <day>
+ * <puzzle_id> <result> <order> <theme> <min rating> <max rating>", the key
+ * being unique to the entry so that it is applied exactly once, and the rest
+ * the queue a "-" entry is taken from (with "*" for no theme) */
+void spool_results(const char * puzzle_id, const char * success_arg) {
+
+  char today[11];
+  struct timespec now;
+  int len = 0;
+  int count = strlen(success_arg);
+
+  get_today(today);
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  char * buffer = malloc(MAX_SPOOL_LINE * count + 2);
+  if(buffer == NULL){
+    printf("ERROR spooling result: out of memory for %d results\n", count);
     return;
   }
 
-  result = sqlite3_step(delete_puzzle_results_stmt);
-  if(result == SQLITE_ERROR) {
-    printf("ERROR deleting puzzle: %s\n", sqlite3_errmsg(dbc));
-    sqlite3_exec(dbc, rollback_transaction_statememt, NULL, NULL, NULL);
+  int fd = open(spool_file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if(fd < 0){
+    printf("ERROR spooling result: %s\n", strerror(errno));
+    free(buffer);
     return;
   }
 
-  sqlite3_exec(dbc, commit_transaction_statement, NULL, NULL, NULL);
-  sqlite3_close(dbc);
-
-}
+  // A write torn by a crash leaves a line with no newline - end it so that it
+  // is skipped on its own rather than swallowing this entry
+  flock(fd, LOCK_EX);
+  struct stat st;
+  char last = '\n';
+  if(fstat(fd, &st) == 0 && st.st_size > 0 && pread(fd, &last, 1, st.st_size - 1) == 1 && last != '\n'){
+    buffer[len++] = '\n';
+  }
 
-void show_upcoming() {
+  for(int i = 0; i < count; i++) {
+    len += snprintf(buffer + len, MAX_SPOOL_LINE, "%lld%09ld-%d-%d %s %s %c %s %s %d %d\n", (long long)now.tv_sec, now.tv_nsec, getpid(), i, today, puzzle_id, success_arg[i],
+      queue_order, strlen(queue_theme) > 0 ? queue_theme : "*", queue_min_rating, queue_max_rating);
+  }
 
-  sqlite3 * dbc = get_db_conn();
-  sqlite3_stmt * upcomming_puzzles_count_stmt;
-  
-  sqlite3_prepare_v2(dbc,get_upcomming_puzzles_count_by_date,strlen(get_upcomming_puzzles_count_by_date),&upcomming_puzzles_count_stmt,NULL);
-  while(sqlite3_step(upcomming_puzzles_count_stmt) == SQLITE_ROW){
-    const char * fmt = "%s - %s\n";
-    char output[20];
-    const char * date = sqlite3_column_text(upcomming_puzzles_count_stmt,0);
-    const char * test_count = sqlite3_column_text(upcomming_puzzles_count_stmt,1);
-    sprintf(output, fmt, date, test_count);
-    puts(output);
+  int written = write(fd, buffer, len);
+  flock(fd, LOCK_UN);
+  if(written != len || fdatasync(fd) != 0){
+    printf("ERROR spooling result: %s\n", strerror(errno));
+  } else {
+    printf("SPOOLED: %d result%s to %s while the database is busy; the next command to reach it will record %s\n", count, count == 1 ? "" : "s", spool_file, count == 1 ? "it" : "them");
   }
+  close(fd);
+  free(buffer);
 
-  sqlite3_finalize(upcomming_puzzles_count_stmt);
+}
 
-  sqlite3_close(dbc);
+/* drain_spool records every spooled result not recorded yet, in the order
+ * they were spooled and each as of the day it was spooled.  A "-" entry goes
+ * to the puzzle then first in the queue it was spooled from, so entries
+ * spooled together go to different puzzles.  It must be called
+ * inside a write transaction, which also records each entry's key in
+ * spool_applied so that an entry read twice is only applied once.  Keys of
+ * entries no longer in the file were emptied out of it and can never be read
+ * again, so they are dropped.  Returns the number of bytes of the spool file
+ * dealt with, copying the first line read into spool_first_line, or -1 if an
+ * entry could not be recorded, in which case the transaction must be rolled
+ * back so that nothing is lost */
+long drain_spool(sqlite3 * dbc) {
+
+  FILE * fh = fopen(spool_file, "r");
+  if(fh == NULL){
+    return errno == ENOENT ? 0 : -1;
+  }
 
-}
+  sqlite3_stmt * applied_stmt = NULL;
+  sqlite3_stmt * seen_stmt = NULL;
+  char line[MAX_SPOOL_LINE];
+  char saved_as_of_day[11], saved_queue_order[10], saved_queue_theme[MAX_THEME_LEN];
+  int saved_min_rating = queue_min_rating, saved_max_rating = queue_max_rating;
+  long consumed = 0;
+  int applied = 0;
+  int failed = 0;
+
+  if(sqlite3_exec(dbc, create_spool_seen_statement, NULL, NULL, NULL) != SQLITE_OK
+     || sqlite3_prepare_v2(dbc, insert_spool_applied_statement, strlen(insert_spool_applied_statement), &applied_stmt, NULL) != SQLITE_OK
+     || sqlite3_prepare_v2(dbc, insert_spool_seen_statement, strlen(insert_spool_seen_statement), &seen_stmt, NULL) != SQLITE_OK){
+    printf("ERROR reading spool: %s\n", sqlite3_errmsg(dbc));
+    sqlite3_finalize(applied_stmt);
+    sqlite3_finalize(seen_stmt);
+    fclose(fh);
+    return -1;
+  }
+  strcpy(saved_as_of_day, as_of_day);
+  strcpy(saved_queue_order, queue_order);
+  strcpy(saved_queue_theme, queue_theme);
+
+  while(!failed && fgets(line, sizeof(line), fh) != NULL){
+    int len = strlen(line);
+    if(line[len - 1] != '\n'){ // still being written, or torn by a crash
+      break;
+    }
+    if(consumed == 0){
+      strcpy(spool_first_line, line);
+    }
 
-void get_scores_for_day(sqlite3 * dbc, char * output, const char * day) {
+    char key[MAX_SPOOL_LINE], day[11], puzzle_id[MAX_PUZZLE_LEN], success_arg[2], order[10], theme[MAX_THEME_LEN];
+    int min_rating, max_rating;
+    int fields = sscanf(line, "%99s %10s %19s %1s %9s %49s %d %d", key, day, puzzle_id, success_arg, order, theme, &min_rating, &max_rating);
+    if((fields != 4 && fields != 8) || !is_valid_day(day) || !check_success_arg(success_arg)){
+      consumed += len; // a torn line, which can never be recorded
+      continue;
+    }
 
-  sqlite3_stmt * get_scores_for_day_stmt;
+    sqlite3_reset(seen_stmt);
+    sqlite3_bind_text(seen_stmt,1,key,strlen(key),SQLITE_TRANSIENT);
+    sqlite3_reset(applied_stmt);
+    sqlite3_bind_text(applied_stmt,1,key,strlen(key),SQLITE_TRANSIENT);
+    if(sqlite3_step(seen_stmt) != SQLITE_DONE || sqlite3_step(applied_stmt) != SQLITE_DONE){
+      printf("ERROR reading spool: %s\n", sqlite3_errmsg(dbc));
+      failed = 1;
+      continue;
+    }
+    if(sqlite3_changes(dbc) == 0){ // recorded by an earlier drain
+      consumed += len;
+      continue;
+    }
 
-  int i = 0;
-  sqlite3_prepare_v2(dbc,get_scores_for_date,strlen(get_scores_for_date),&get_scores_for_day_stmt,NULL);
-  sqlite3_bind_text(get_scores_for_day_stmt,1,day,strlen(day),NULL);
-  while(sqlite3_step(get_scores_for_day_stmt) == SQLITE_ROW){
-    const char * fmt = "%d - %d\n";
-    char buf[20];
-    int score = sqlite3_column_int(get_scores_for_day_stmt, 0);
-    int count = sqlite3_column_int(get_scores_for_day_stmt, 1);
-    sprintf(buf, fmt, score, count);
-    if(i == 0){
-      strcpy(output, buf);
-      i++;
-    } else {
-      strcat(output, buf);
+    strcpy(as_of_day, day);
+    if(fields == 8){ // entries spooled before the queue was recorded use this command's
+      strcpy(queue_order, order);
+      strcpy(queue_theme, strcmp(theme, "*") == 0 ? "" : theme);
+      queue_min_rating = min_rating;
+      queue_max_rating = max_rating;
+    }
+    if(strcmp(puzzle_id, "-") == 0){
+      current_puzzle(dbc, puzzle_id);
+      if(strlen(puzzle_id) == 0){
+        printf("ERROR recording spooled result: no puzzle was due on %s\n", day);
+        consumed += len;
+        continue;
+      }
+    }
+
+    int result = check_puzzle_exists(dbc, puzzle_id) ? update_existing_puzzle(dbc, puzzle_id, success_arg) : create_new_puzzle_entry(dbc, puzzle_id, success_arg);
+    if(result != SQLITE_OK){
+      failed = 1;
+      continue;
     }
+    applied++;
+    consumed += len;
   }
-}
 
-int main(int argc, char** argv) {
+  strcpy(as_of_day, saved_as_of_day);
+  strcpy(queue_order, saved_queue_order);
+  strcpy(queue_theme, saved_queue_theme);
+  queue_min_rating = saved_min_rating;
+  queue_max_rating = saved_max_rating;
+  sqlite3_finalize(applied_stmt);
+  sqlite3_finalize(seen_stmt);
+  fclose(fh);
+
+  if(!failed && sqlite3_exec(dbc, prune_spool_applied_statement, NULL, NULL, NULL) != SQLITE_OK){
+    printf("ERROR reading spool: %s\n", sqlite3_errmsg(dbc));
+    failed = 1;
+  }
+  if(failed){
+    return -1;
+  }
 
-  char * command_arg;
-  char * success_arg;
-  if(argc > 3){
-    print_useage();
-    return 0;
+  if(applied > 0){
+    fprintf(get_report_stream(), "SPOOL: recorded %d spooled result%s\n", applied, applied == 1 ? "" : "s");
   }
 
+  return consumed;
 
-  if(argc == 1){
-    get_next();
+}
+
+/* truncate_spool empties the spool file once the <consumed> bytes starting
+ * with first_line have been recorded, unless more entries were appended since
+ * they were read.  Checking the first line, whose key is unique, as well as the
+ * size tells the file apart from one emptied by another process and refilled
+ * to the same size.  Returns true if the file was emptied */
+int truncate_spool(long consumed, const char * first_line) {
+
+  int fd = open(spool_file, O_RDWR);
+  int truncated = 0;
+  int first_len = strlen(first_line);
+  char buffer[MAX_SPOOL_LINE];
+  struct stat st;
+
+  if(fd < 0){
     return 0;
   }
 
-  command_arg = argv[1];
+  flock(fd, LOCK_EX);
+  if(fstat(fd, &st) == 0 && st.st_size == consumed && pread(fd, buffer, first_len, 0) == first_len && memcmp(buffer, first_line, first_len) == 0){
+    truncated = ftruncate(fd, 0) == 0;
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
 
-  if(argc == 2) {
+  return truncated;
 
-    if(strcmp(command_arg, "next") == 0){
-      get_next();
-      return 0;
-    } 
+}
 
-    if(strcmp(command_arg, "stats") == 0){
-      show_stats();
-      return 0;
+/* begin_write starts an immediate transaction, waiting for the write lock no
+ * longer than the connection's busy timeout, and records any spooled results
+ * first so they land before the command's own writes.  The spool is only
+ * drained into an up to date schema, and if any of it cannot be recorded the
+ * drain is rolled back, leaving it all in the spool, and the transaction
+ * started again without it.  Returns the result of begin */
+int begin_write(sqlite3 * dbc) {
+
+  int result = sqlite3_exec(dbc, begin_immediate_statement, NULL, NULL, NULL);
+  if(result != SQLITE_OK){
+    return result;
+  }
+  write_report = open_memstream(&write_report_buffer, &write_report_len);
+
+  if(spool_pending() && schema_is_current(dbc)){
+    long consumed = drain_spool(dbc);
+    if(consumed < 0){
+      rollback_write(dbc);
+      printf("ERROR recording spooled results: they stay in %s\n", spool_file);
+      result = sqlite3_exec(dbc, begin_immediate_statement, NULL, NULL, NULL);
+      if(result == SQLITE_OK){
+        write_report = open_memstream(&write_report_buffer, &write_report_len);
+      }
+      return result;
     }
+    spool_consumed = consumed;
+  }
 
-    if(strcmp(command_arg, "future") == 0){
-      show_upcoming();
-      return 0;
+  return result;
+
+}
+
+/* get_report_stream returns where to report recorded results: held until
+ * commit inside a write transaction, straight to stdout otherwise */
+FILE * get_report_stream() {
+  return write_report != NULL ? write_report : stdout;
+}
+
+/* end_write_report prints what the write transaction reported if it was
+ * saved and discards it if not */
+void end_write_report(int saved) {
+
+  if(write_report == NULL){
+    return;
+  }
+
+  fclose(write_report);
+  if(saved){
+    fwrite(write_report_buffer, 1, write_report_len, stdout);
+  }
+  free(write_report_buffer);
+  write_report = NULL;
+  write_report_buffer = NULL;
+  write_report_len = 0;
+
+}
+
+/* commit_write commits a transaction started with begin_write, rolling it
+ * back if the commit fails, and empties the spool if it was drained.  Returns
+ * the result of commit */
+int commit_write(sqlite3 * dbc) {
+
+  int result = sqlite3_exec(dbc, commit_transaction_statement, NULL, NULL, NULL);
+  if(result != SQLITE_OK){
+    sqlite3_exec(dbc, rollback_transaction_statememt, NULL, NULL, NULL);
+  } else {
+    record_result_metric(pending_results);
+    if(spool_consumed > 0){
+      truncate_spool(spool_consumed, spool_first_line);
+    }
+  }
+  spool_consumed = 0;
+  pending_results = 0;
+  end_write_report(result == SQLITE_OK);
+
+  return result;
+
+}
+
+/* rollback_write abandons a transaction started with begin_write, leaving any
+ * spooled results it drained in the spool */
+void rollback_write(sqlite3 * dbc) {
+
+  sqlite3_exec(dbc, rollback_transaction_statememt, NULL, NULL, NULL);
+  spool_consumed = 0;
+  pending_results = 0;
+  end_write_report(0);
+
+}
+
+/* get_recording_conn returns a connection for recording a result, which never
+ * waits for a lock (SPOOL_BUSY_TIMEOUT_MS is 0) so that a busy database sends
+ * the result to the spool instead of holding the user up */
+sqlite3* get_recording_conn() {
+
+  db_busy_timeout_ms = SPOOL_BUSY_TIMEOUT_MS;
+
+  return get_db_conn();
+
+}
+
+/* delete_puzzle takes a puzzle_id and creates a database connecton which it
+ * uses to delete the puzzle from the database completely, including records of
+ * results */
+void delete_puzzle(char * puzzle_id) {
+  sqlite3 * dbc = get_db_conn();
+  sqlite3_stmt * delete_puzzle_stmt;
+  sqlite3_stmt * delete_puzzle_results_stmt;
+  sqlite3_prepare_v2(dbc, delete_puzzle_from_puzzles_statement, strlen(delete_puzzle_from_puzzles_statement), &delete_puzzle_stmt, NULL);
+  sqlite3_prepare_v2(dbc, delete_puzzle_from_results_statement, strlen(delete_puzzle_from_results_statement), &delete_puzzle_results_stmt, NULL);
+
+  sqlite3_bind_text(delete_puzzle_stmt,1,puzzle_id,strlen(puzzle_id),NULL);
+  sqlite3_bind_text(delete_puzzle_results_stmt,1,puzzle_id,strlen(puzzle_id),NULL);
+
+  if(begin_write(dbc) != SQLITE_OK) {
+    printf("ERROR deleting puzzle: %s\n", sqlite3_errmsg(dbc));
+    sqlite3_finalize(delete_puzzle_stmt);
+    sqlite3_finalize(delete_puzzle_results_stmt);
+    release_db_conn(dbc);
+    return;
+  }
+
+  int result = sqlite3_step(delete_puzzle_stmt);
+  if(result == SQLITE_DONE) {
+    result = sqlite3_step(delete_puzzle_results_stmt);
+  }
+  if(result != SQLITE_DONE) {
+    printf("ERROR deleting puzzle: %s\n", sqlite3_errmsg(dbc));
+  }
+  sqlite3_finalize(delete_puzzle_stmt);
+  sqlite3_finalize(delete_puzzle_results_stmt);
+
+  if(result != SQLITE_DONE) {
+    rollback_write(dbc);
+  } else if(commit_write(dbc) != SQLITE_OK) {
+    printf("ERROR deleting puzzle: %s\n", sqlite3_errmsg(dbc));
+  }
+
+  release_db_conn(dbc);
+
+}
+
+/* show_upcoming prints the number of puzzles slated for each day from today
+ * on, read from the due_counts histogram.  Puzzles whose day has already
+ * passed are summed into a single OVERDUE line */
+void show_upcoming() {
+
+  sqlite3 * dbc = get_db_conn();
+  print_due_histogram(dbc);
+  release_db_conn(dbc);
+
+}
+
+/* print_due_histogram takes a database connection and prints the overdue
+ * count and per-day counts from due_counts for show_upcoming */
+void print_due_histogram(sqlite3 * dbc) {
+
+  sqlite3_stmt * upcomming_puzzles_count_stmt;
+  sqlite3_stmt * overdue_puzzles_count_stmt;
+  char today[11];
+  get_today(today);
+
+  sqlite3_prepare_v2(dbc,get_overdue_puzzles_count,strlen(get_overdue_puzzles_count),&overdue_puzzles_count_stmt,NULL);
+  sqlite3_bind_text(overdue_puzzles_count_stmt,1,today,strlen(today),NULL);
+  if(sqlite3_step(overdue_puzzles_count_stmt) == SQLITE_ROW && sqlite3_column_int(overdue_puzzles_count_stmt,0) > 0){
+    printf("OVERDUE - %d\n\n", sqlite3_column_int(overdue_puzzles_count_stmt,0));
+  }
+  sqlite3_finalize(overdue_puzzles_count_stmt);
+
+  sqlite3_prepare_v2(dbc,get_upcomming_puzzles_count_by_date,strlen(get_upcomming_puzzles_count_by_date),&upcomming_puzzles_count_stmt,NULL);
+  sqlite3_bind_text(upcomming_puzzles_count_stmt,1,today,strlen(today),NULL);
+  while(sqlite3_step(upcomming_puzzles_count_stmt) == SQLITE_ROW){
+    const char * fmt = "%s - %s\n";
+    char output[40];
+    const char * date = sqlite3_column_text(upcomming_puzzles_count_stmt,0);
+    const char * test_count = sqlite3_column_text(upcomming_puzzles_count_stmt,1);
+    sprintf(output, fmt, date, test_count);
+    puts(output);
+  }
+
+  sqlite3_finalize(upcomming_puzzles_count_stmt);
+
+}
+
+/* replay_result advances a puzzle's replay_state by one entry of the results
+ * log, applying the same rule update_puzzle does when the result is first
+ * recorded: a puzzle's first result sets the score to 0 and queues it for the
+ * next day.  After that, with ALGORITHM_FIBONACCI a failure resets the score
+ * to 0 and a success increments it and queues the puzzle fibonacci1(score)
+ * days out.  With ALGORITHM_SM2 each result is fed to sm2 as a grade of
+ * SM2_SUCCESS_GRADE or SM2_FAILURE_GRADE and the score is its count of
+ * successes in a row */
+void replay_result(struct replay_state * state, int day, const char * success_arg, int algorithm) {
+
+  if(state->results == 0){
+    state->score = 0;
+    state->next_day = day + 1;
+    state->interval.successes = 0;
+    state->interval.easiness_factor = SM2_INITIAL_EASINESS;
+    state->interval.interval = 1;
+  } else if(algorithm == ALGORITHM_SM2) {
+    sm2(strcmp(success_arg, "f") == 0 ? SM2_FAILURE_GRADE : SM2_SUCCESS_GRADE, &state->interval);
+    state->score = state->interval.successes;
+    state->next_day = day + state->interval.interval;
+  } else if(strcmp(success_arg, "f") == 0) {
+    state->score = 0;
+    state->next_day = day + 1;
+  } else {
+    state->score += 1;
+    state->next_day = day + fibonacci1(state->score);
+  }
+
+  state->results += 1;
+
+}
+
+/* replay_puzzle_history takes a database connection, the schema name of an
+ * attached database ("main" for the connection's own) and a puzzle id and
+ * replays every result logged for that puzzle up to today into state */
+void replay_puzzle_history(sqlite3 * dbc, const char * schema, char * puzzle_id, struct replay_state * state, int algorithm) {
+
+  sqlite3_stmt * history_stmt;
+  char today[11];
+  get_today(today);
+
+  snprintf(state->puzzle_id, MAX_PUZZLE_LEN, "%s", puzzle_id);
+  state->results = 0;
+
+  char * history_statement = sqlite3_mprintf(get_puzzle_history_statement, schema);
+  sqlite3_prepare_v2(dbc, history_statement, -1, &history_stmt, NULL);
+  sqlite3_free(history_statement);
+  sqlite3_bind_text(history_stmt,1,puzzle_id,strlen(puzzle_id),NULL);
+  sqlite3_bind_text(history_stmt,2,today,strlen(today),NULL);
+
+  while(sqlite3_step(history_stmt) == SQLITE_ROW){
+    const char * date = (const char *)sqlite3_column_text(history_stmt,0);
+    const char * success_arg = (const char *)sqlite3_column_text(history_stmt,1);
+    replay_result(state, day_number(date), success_arg, algorithm);
+  }
+
+  sqlite3_finalize(history_stmt);
+
+}
+
+/* get_setting takes a database connection, a schema name and a settings key
+ * and copies its value into buffer, or default_value if it has not been set */
+void get_setting(sqlite3 * dbc, const char * schema, const char * key, char * buffer, int buffer_len, const char * default_value) {
+
+  sqlite3_stmt * get_setting_stmt;
+
+  snprintf(buffer, buffer_len, "%s", default_value);
+
+  char * setting_statement = sqlite3_mprintf(get_setting_statement, schema);
+  sqlite3_prepare_v2(dbc, setting_statement, -1, &get_setting_stmt, NULL);
+  sqlite3_free(setting_statement);
+  sqlite3_bind_text(get_setting_stmt,1,key,strlen(key),NULL);
+  if(sqlite3_step(get_setting_stmt) == SQLITE_ROW){
+    snprintf(buffer, buffer_len, "%s", (const char *)sqlite3_column_text(get_setting_stmt,0));
+  }
+  sqlite3_finalize(get_setting_stmt);
+
+}
+
+/* set_setting takes a database connection, a schema name, a settings key and
+ * a value and saves the value under that key */
+int set_setting(sqlite3 * dbc, const char * schema, const char * key, const char * value) {
+
+  sqlite3_stmt * set_setting_stmt;
+
+  char * setting_statement = sqlite3_mprintf(set_setting_statement, schema);
+  int result = sqlite3_prepare_v2(dbc, setting_statement, -1, &set_setting_stmt, NULL);
+  sqlite3_free(setting_statement);
+  if(result == SQLITE_OK){
+    sqlite3_bind_text(set_setting_stmt,1,key,strlen(key),NULL);
+    sqlite3_bind_text(set_setting_stmt,2,value,strlen(value),NULL);
+    result = sqlite3_step(set_setting_stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(dbc);
+  }
+  if(result != SQLITE_OK){
+    printf("ERROR saving setting %s: %s\n", key, sqlite3_errmsg(dbc));
+  }
+  sqlite3_finalize(set_setting_stmt);
+
+  return result;
+
+}
+
+/* get_algorithm_by_name returns the ALGORITHM_ constant for an interval
+ * algorithm name, or -1 if there is no such algorithm */
+int get_algorithm_by_name(const char * name) {
+
+  for(int i = 0; i < (int)(sizeof(algorithm_names) / sizeof(algorithm_names[0])); i++) {
+    if(strcmp(name, algorithm_names[i]) == 0){
+      return i;
+    }
+  }
+
+  return -1;
+
+}
+
+/* get_schedule_algorithm takes a database connection and a schema name and
+ * returns the interval algorithm that deck was last rescheduled with,
+ * ALGORITHM_FIBONACCI if it never was */
+int get_schedule_algorithm(sqlite3 * dbc, const char * schema) {
+
+  char name[20];
+  get_setting(dbc, schema, "algorithm", name, sizeof(name), algorithm_names[ALGORITHM_FIBONACCI]);
+
+  int algorithm = get_algorithm_by_name(name);
+  return algorithm < 0 ? ALGORITHM_FIBONACCI : algorithm;
+
+}
+
+/* get_next_test_on_success takes a database connection and a puzzle id and
+ * works out the score the puzzle would have and the day it would next be
+ * tested if it were passed today, under the deck's interval algorithm */
+void get_next_test_on_success(sqlite3 * dbc, char * puzzle_id, int * score, char * next_test_day) {
+
+  int algorithm = get_schedule_algorithm(dbc, "main");
+
+  if(algorithm == ALGORITHM_FIBONACCI){
+    *score = get_score_for_puzzle(dbc, puzzle_id) + 1;
+    get_target_day(next_test_day, fibonacci1(*score));
+    return;
+  }
+
+  struct replay_state state;
+  char today[11];
+  get_today(today);
+
+  replay_puzzle_history(dbc, "main", puzzle_id, &state, algorithm);
+  replay_result(&state, day_number(today), "s", algorithm);
+
+  *score = state.score;
+  day_from_number(next_test_day, state.next_day);
+
+}
+
+/* save_replay_state writes the score and next test date a replay arrived at
+ * for one puzzle using the prepared insert statement */
+int save_replay_state(sqlite3 * dbc, sqlite3_stmt * insert_stmt, struct replay_state * state) {
+
+  char next_test_day[11];
+  day_from_number(next_test_day, state->next_day);
+
+  sqlite3_reset(insert_stmt);
+  sqlite3_bind_text(insert_stmt,1,state->puzzle_id,strlen(state->puzzle_id),SQLITE_TRANSIENT);
+  sqlite3_bind_int(insert_stmt,2,state->score);
+  sqlite3_bind_text(insert_stmt,3,next_test_day,strlen(next_test_day),SQLITE_TRANSIENT);
+
+  int result = sqlite3_step(insert_stmt);
+  if(result != SQLITE_DONE){
+    printf("ERROR saving replayed puzzle %s: %s\n", state->puzzle_id, sqlite3_errmsg(dbc));
+    return result;
+  }
+
+  return SQLITE_OK;
+
+}
+
+/* count_rows runs a statement returning a single count and returns it */
+int count_rows(sqlite3 * dbc, const char * statement) {
+
+  sqlite3_stmt * count_stmt;
+  int count = 0;
+
+  sqlite3_prepare_v2(dbc, statement, strlen(statement), &count_stmt, NULL);
+  if(sqlite3_step(count_stmt) == SQLITE_ROW){
+    count = sqlite3_column_int(count_stmt, 0);
+  } else {
+    printf("ERROR counting rows: %s\n", sqlite3_errmsg(dbc));
+  }
+  sqlite3_finalize(count_stmt);
+
+  return count;
+
+}
+
+/* rebuild_schedule regenerates the puzzles table from the results log.  It
+ * streams every result up to and including today ordered by puzzle and date,
+ * replays each puzzle's history into a temporary table, reports how that
+ * differs from the current puzzles table and - unless check_only is set -
+ * applies the difference in the same write transaction, reporting it once it
+ * is saved.  Advances made with 'a' are not logged as results and so are not
+ * preserved */
+void rebuild_schedule(int check_only) {
+
+  sqlite3 * dbc = get_db_conn();
+  sqlite3_stmt * replay_stmt;
+  sqlite3_stmt * insert_stmt;
+  char * error_message = 0;
+  struct replay_state state;
+  int replayed = 0;
+  int puzzles = 0;
+
+  char today[11];
+  get_today(today);
+
+  if(begin_write(dbc) != SQLITE_OK){
+    printf("ERROR rebuilding schedule: %s\n", sqlite3_errmsg(dbc));
+    release_db_conn(dbc);
+    return;
+  }
+  sqlite3_exec(dbc, create_rebuilt_puzzles_table, NULL, NULL, &error_message);
+  if(error_message != 0){
+    printf("ERROR rebuilding schedule: %s\n", error_message);
+    sqlite3_free(error_message);
+    rollback_write(dbc);
+    release_db_conn(dbc);
+    return;
+  }
+
+  int algorithm = get_schedule_algorithm(dbc, "main");
+
+  int result = sqlite3_prepare_v2(dbc, get_replay_results_statement, strlen(get_replay_results_statement), &replay_stmt, NULL);
+  if(result == SQLITE_OK){
+    result = sqlite3_prepare_v2(dbc, insert_rebuilt_puzzle_statement, strlen(insert_rebuilt_puzzle_statement), &insert_stmt, NULL);
+  }
+  if(result != SQLITE_OK){
+    printf("ERROR replaying results: %s\n", sqlite3_errmsg(dbc));
+    sqlite3_finalize(replay_stmt);
+    rollback_write(dbc);
+    release_db_conn(dbc);
+    return;
+  }
+  sqlite3_bind_text(replay_stmt,1,today,strlen(today),NULL);
+
+  state.puzzle_id[0] = '\0';
+  state.results = 0;
+
+  int saved = SQLITE_OK;
+  while(saved == SQLITE_OK && (result = sqlite3_step(replay_stmt)) == SQLITE_ROW){
+    const char * puzzle_id = (const char *)sqlite3_column_text(replay_stmt,0);
+    const char * date = (const char *)sqlite3_column_text(replay_stmt,1);
+    const char * success_arg = (const char *)sqlite3_column_text(replay_stmt,2);
+
+    if(strcmp(puzzle_id, state.puzzle_id) != 0){
+      if(state.results > 0){
+        saved = save_replay_state(dbc, insert_stmt, &state);
+        puzzles++;
+      }
+      snprintf(state.puzzle_id, MAX_PUZZLE_LEN, "%s", puzzle_id);
+      state.results = 0;
+    }
+
+    replay_result(&state, day_number(date), success_arg, algorithm);
+    replayed++;
+  }
+
+  if(saved == SQLITE_OK && result == SQLITE_DONE && state.results > 0){
+    saved = save_replay_state(dbc, insert_stmt, &state);
+    puzzles++;
+  }
+
+  sqlite3_finalize(replay_stmt);
+  sqlite3_finalize(insert_stmt);
+
+  if(saved != SQLITE_OK){
+    rollback_write(dbc);
+    release_db_conn(dbc);
+    return;
+  }
+  if(result != SQLITE_DONE){
+    printf("ERROR replaying results: %s\n", sqlite3_errmsg(dbc));
+    rollback_write(dbc);
+    release_db_conn(dbc);
+    return;
+  }
+
+  int changed = count_rows(dbc, count_rebuilt_changed_statement);
+  int added = count_rows(dbc, count_rebuilt_added_statement);
+  int removed = count_rows(dbc, count_rebuilt_removed_statement);
+
+  if(check_only){
+    rollback_write(dbc);
+    printf("REPLAYED: %d results for %d puzzles as of %s\n", replayed, puzzles, today);
+    printf("CHANGED: %d\nADDED: %d\nREMOVED: %d\n", changed, added, removed);
+    release_db_conn(dbc);
+    return;
+  }
+
+  sqlite3_exec(dbc, apply_rebuilt_changed_statement, NULL, NULL, &error_message);
+  if(error_message == 0){
+    sqlite3_exec(dbc, apply_rebuilt_added_statement, NULL, NULL, &error_message);
+  }
+  if(error_message == 0){
+    sqlite3_exec(dbc, apply_rebuilt_removed_statement, NULL, NULL, &error_message);
+  }
+  if(error_message != 0){
+    printf("ERROR saving rebuilt schedule: %s\n", error_message);
+    sqlite3_free(error_message);
+    rollback_write(dbc);
+    release_db_conn(dbc);
+    return;
+  }
+
+  sqlite3_exec(dbc, drop_rebuilt_puzzles_table, NULL, NULL, NULL);
+  if(commit_write(dbc) != SQLITE_OK){
+    printf("ERROR saving rebuilt schedule: %s\n", sqlite3_errmsg(dbc));
+  } else {
+    printf("REPLAYED: %d results for %d puzzles as of %s\n", replayed, puzzles, today);
+    printf("CHANGED: %d\nADDED: %d\nREMOVED: %d\n", changed, added, removed);
+  }
+  release_db_conn(dbc);
+
+}
+
+/* normalize_theme copies up to <len> characters of a theme name into buffer,
+ * lowercased so filters match regardless of how the catalog spelled it */
+void normalize_theme(char * buffer, const char * theme, int len) {
+
+  int i;
+  for(i = 0; i < len && i < MAX_THEME_LEN - 1; i++) {
+    buffer[i] = tolower((unsigned char)theme[i]);
+  }
+  buffer[i] = '\0';
+
+}
+
+/* split_csv_line splits a line of CSV in place into at most <max_fields>
+ * fields, unquoting quoted fields, and returns the number of fields found */
+int split_csv_line(char * line, char ** fields, int max_fields) {
+
+  int count = 0;
+  char * read = line;
+
+  while(count < max_fields) {
+    char * write = read;
+    fields[count++] = write;
+
+    if(*read == '"'){
+      read++;
+      while(*read != '\0'){
+        if(*read == '"' && *(read + 1) == '"'){
+          *write++ = '"';
+          read += 2;
+        } else if(*read == '"'){
+          read++;
+          break;
+        } else {
+          *write++ = *read++;
+        }
+      }
+    }
+
+    while(*read != '\0' && *read != ',' && *read != '\n' && *read != '\r'){
+      *write++ = *read++;
+    }
+
+    int at_end = *read != ',';
+    *write = '\0';
+    if(at_end){
+      break;
+    }
+    read++;
+  }
+
+  return count;
+
+}
+
+/* get_json_field finds "<key>": in a single line JSON object and copies its
+ * value into buffer - the contents of a string, the inside of an array or a
+ * bare number - returning false if the key is missing */
+int get_json_field(const char * line, const char * key, char * buffer, int buffer_len) {
+
+  char quoted_key[40];
+  snprintf(quoted_key, sizeof(quoted_key), "\"%s\"", key);
+
+  const char * pch = strstr(line, quoted_key);
+  if(pch == NULL){
+    return 0;
+  }
+
+  pch += strlen(quoted_key);
+  while(isspace((unsigned char)*pch)){
+    pch++;
+  }
+  if(*pch != ':'){
+    return 0;
+  }
+  pch++;
+  while(isspace((unsigned char)*pch)){
+    pch++;
+  }
+
+  char end_char = ',';
+  if(*pch == '"'){
+    end_char = '"';
+    pch++;
+  } else if(*pch == '['){
+    end_char = ']';
+    pch++;
+  }
+
+  int i = 0;
+  while(*pch != '\0' && i < buffer_len - 1){
+    if(*pch == '\\' && *(pch + 1) != '\0'){
+      pch++;
+    } else if(*pch == end_char || (end_char == ',' && (*pch == '}' || isspace((unsigned char)*pch)))){
+      break;
+    }
+    buffer[i++] = *pch++;
+  }
+  buffer[i] = '\0';
+
+  return 1;
+
+}
+
+/* add_catalog_entry saves the rating and themes for one puzzle, given as the
+ * raw id (or url), rating and theme list fields read from the catalog file.
+ * Themes may be separated by spaces, commas, semicolons or pipes.  Returns 1
+ * once saved, 0 if the entry has no usable puzzle id and -1 if it could not
+ * be saved */
+int add_catalog_entry(sqlite3 * dbc, sqlite3_stmt ** catalog_stmts, const char * id_field, const char * rating_field, const char * themes_field) {
+
+  char puzzle_id[MAX_PUZZLE_LEN];
+  int digits = 0;
+
+  for(const char * pch = id_field; *pch != '\0'; pch++) {
+    digits += isdigit((unsigned char)*pch) != 0;
+  }
+  if(digits == 0 || digits >= MAX_PUZZLE_LEN){
+    return 0;
+  }
+  get_puzzle_id(puzzle_id, (char *)id_field);
+
+  sqlite3_stmt * insert_stmt = catalog_stmts[0];
+  sqlite3_stmt * delete_themes_stmt = catalog_stmts[1];
+  sqlite3_stmt * insert_theme_stmt = catalog_stmts[2];
+
+  sqlite3_reset(insert_stmt);
+  sqlite3_bind_text(insert_stmt,1,puzzle_id,strlen(puzzle_id),SQLITE_TRANSIENT);
+  if(rating_field != NULL && isdigit((unsigned char)rating_field[0])){
+    sqlite3_bind_int(insert_stmt,2,atoi(rating_field));
+  } else {
+    sqlite3_bind_null(insert_stmt,2);
+  }
+  if(sqlite3_step(insert_stmt) != SQLITE_DONE){
+    printf("ERROR saving catalog entry for %s: %s\n", puzzle_id, sqlite3_errmsg(dbc));
+    return -1;
+  }
+
+  sqlite3_reset(delete_themes_stmt);
+  sqlite3_bind_text(delete_themes_stmt,1,puzzle_id,strlen(puzzle_id),SQLITE_TRANSIENT);
+  if(sqlite3_step(delete_themes_stmt) != SQLITE_DONE){
+    printf("ERROR saving catalog themes for %s: %s\n", puzzle_id, sqlite3_errmsg(dbc));
+    return -1;
+  }
+
+  if(themes_field == NULL){
+    return 1;
+  }
+
+  const char * separators = " ,;|\"\t\r\n";
+  const char * pch = themes_field;
+  while(*pch != '\0'){
+    pch += strspn(pch, separators);
+    int len = strcspn(pch, separators);
+    if(len == 0){
+      break;
+    }
+
+    char theme[MAX_THEME_LEN];
+    normalize_theme(theme, pch, len);
+    pch += len;
+
+    sqlite3_reset(insert_theme_stmt);
+    sqlite3_bind_text(insert_theme_stmt,1,theme,strlen(theme),SQLITE_TRANSIENT);
+    sqlite3_bind_text(insert_theme_stmt,2,puzzle_id,strlen(puzzle_id),SQLITE_TRANSIENT);
+    if(sqlite3_step(insert_theme_stmt) != SQLITE_DONE){
+      printf("ERROR saving catalog themes for %s: %s\n", puzzle_id, sqlite3_errmsg(dbc));
+      return -1;
+    }
+  }
+
+  return 1;
+
+}
+
+/* import_catalog loads puzzle metadata from a local file into the catalog
+ * tables in a single transaction.  Lines starting with '{' are read as NDJSON
+ * objects with id (or puzzle_id or url), rating and themes keys; other lines
+ * are read as CSV.  A CSV header naming id, rating and themes columns is
+ * recognised, otherwise the columns are taken to be puzzle_id,rating,themes.
+ * Importing a puzzle again replaces its rating and themes.  If anything cannot
+ * be saved the whole import is rolled back */
+void import_catalog(char * path) {
+
+  FILE * catalog_file = fopen(path, "r");
+  if(catalog_file == NULL){
+    print_error(errno, __LINE__ - 2);
+    return;
+  }
+
+  sqlite3 * dbc = get_db_conn();
+  sqlite3_stmt * catalog_stmts[3];
+  sqlite3_prepare_v2(dbc, insert_catalog_statement, strlen(insert_catalog_statement), &catalog_stmts[0], NULL);
+  sqlite3_prepare_v2(dbc, delete_catalog_themes_statement, strlen(delete_catalog_themes_statement), &catalog_stmts[1], NULL);
+  sqlite3_prepare_v2(dbc, insert_catalog_theme_statement, strlen(insert_catalog_theme_statement), &catalog_stmts[2], NULL);
+
+  int id_column = 0, rating_column = 1, themes_column = 2;
+  int imported = 0, skipped = 0, line_number = 0;
+  int failed = 0;
+  char * line = NULL;
+  size_t line_len = 0;
+
+  sqlite3_exec(dbc, bulk_load_cache_statement, NULL, NULL, NULL);
+  if(begin_write(dbc) != SQLITE_OK){
+    printf("ERROR importing catalog: %s\n", sqlite3_errmsg(dbc));
+    fclose(catalog_file);
+    for(int i = 0; i < 3; i++) {
+      sqlite3_finalize(catalog_stmts[i]);
+    }
+    release_db_conn(dbc);
+    return;
+  }
+
+  while(!failed && getline(&line, &line_len, catalog_file) != -1) {
+    line_number++;
+    char * start = line + strspn(line, " \t");
+    if(*start == '\n' || *start == '\r' || *start == '\0'){
+      continue;
+    }
+
+    if(*start == '{'){
+      char id_field[200], rating_field[20], themes_field[1000];
+      if(!get_json_field(start, "id", id_field, sizeof(id_field)) && !get_json_field(start, "puzzle_id", id_field, sizeof(id_field)) && !get_json_field(start, "url", id_field, sizeof(id_field))){
+        skipped++;
+        continue;
+      }
+      int has_rating = get_json_field(start, "rating", rating_field, sizeof(rating_field));
+      int has_themes = get_json_field(start, "themes", themes_field, sizeof(themes_field));
+      int added = add_catalog_entry(dbc, catalog_stmts, id_field, has_rating ? rating_field : NULL, has_themes ? themes_field : NULL);
+      if(added > 0){
+        imported++;
+      } else if(added == 0) {
+        skipped++;
+      } else {
+        failed = 1;
+      }
+      continue;
+    }
+
+    char * fields[MAX_CATALOG_COLUMNS];
+    int field_count = split_csv_line(start, fields, MAX_CATALOG_COLUMNS);
+
+    if(line_number == 1 && strpbrk(fields[0], "0123456789") == NULL){ // header
+      id_column = rating_column = themes_column = -1;
+      for(int i = 0; i < field_count; i++) {
+        char name[MAX_THEME_LEN];
+        normalize_theme(name, fields[i], strlen(fields[i]));
+        if(strcmp(name, "id") == 0 || strcmp(name, "puzzle_id") == 0 || strcmp(name, "puzzleid") == 0 || strcmp(name, "url") == 0){
+          id_column = i;
+        } else if(strcmp(name, "rating") == 0){
+          rating_column = i;
+        } else if(strcmp(name, "themes") == 0 || strcmp(name, "theme") == 0){
+          themes_column = i;
+        }
+      }
+      if(id_column < 0){
+        printf("ERROR importing catalog: no id column in header of %s\n", path);
+        failed = 1;
+      }
+      continue;
+    }
+
+    if(id_column >= field_count){
+      skipped++;
+      continue;
+    }
+
+    const char * rating_field = rating_column >= 0 && rating_column < field_count ? fields[rating_column] : NULL;
+    const char * themes_field = themes_column >= 0 && themes_column < field_count ? fields[themes_column] : NULL;
+    int added = add_catalog_entry(dbc, catalog_stmts, fields[id_column], rating_field, themes_field);
+    if(added > 0){
+      imported++;
+    } else if(added == 0) {
+      skipped++;
+    } else {
+      failed = 1;
+    }
+  }
+
+  free(line);
+  fclose(catalog_file);
+  for(int i = 0; i < 3; i++) {
+    sqlite3_finalize(catalog_stmts[i]);
+  }
+
+  if(failed){
+    rollback_write(dbc);
+    printf("ERROR importing catalog - nothing was imported\n");
+  } else if(commit_write(dbc) != SQLITE_OK) {
+    printf("ERROR importing catalog - nothing was imported: %s\n", sqlite3_errmsg(dbc));
+  } else {
+    printf("IMPORTED: %d\nSKIPPED: %d\n", imported, skipped);
+  }
+
+  release_db_conn(dbc);
+
+}
+
+/* replay_partition is the body of a reschedule thread.  It opens its own
+ * read-only connection, streams the results for its share of the deck in
+ * puzzle and date order and collects one replay_state per puzzle */
+void * replay_partition(void * arg) {
+
+  struct reschedule_worker * worker = arg;
+  sqlite3 * dbc = 0;
+  sqlite3_stmt * replay_stmt;
+
+  worker->count = 0;
+  worker->capacity = 1024;
+  worker->states = malloc(sizeof(struct replay_state) * worker->capacity);
+  worker->failed = 0;
+
+  if(worker->states == NULL){
+    printf("ERROR replaying results: out of memory\n");
+    worker->failed = 1;
+    return NULL;
+  }
+
+  if(sqlite3_open_v2(get_database_path(), &dbc, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI, NULL) != SQLITE_OK){
+    printf("ERROR opening read-only connection: %s\n", sqlite3_errmsg(dbc));
+    sqlite3_close(dbc);
+    worker->failed = 1;
+    return NULL;
+  }
+
+  if(sqlite3_prepare_v2(dbc, get_partition_results_statement, strlen(get_partition_results_statement), &replay_stmt, NULL) != SQLITE_OK){
+    printf("ERROR replaying results: %s\n", sqlite3_errmsg(dbc));
+    sqlite3_close(dbc);
+    worker->failed = 1;
+    return NULL;
+  }
+  sqlite3_bind_text(replay_stmt,1,worker->first_puzzle_id,strlen(worker->first_puzzle_id),NULL);
+  sqlite3_bind_text(replay_stmt,2,worker->last_puzzle_id,strlen(worker->last_puzzle_id),NULL);
+  sqlite3_bind_text(replay_stmt,3,worker->today,strlen(worker->today),NULL);
+
+  struct replay_state * state = NULL;
+  int result;
+  while((result = sqlite3_step(replay_stmt)) == SQLITE_ROW){
+    const char * puzzle_id = (const char *)sqlite3_column_text(replay_stmt,0);
+    const char * date = (const char *)sqlite3_column_text(replay_stmt,1);
+    const char * success_arg = (const char *)sqlite3_column_text(replay_stmt,2);
+
+    if(state == NULL || strcmp(puzzle_id, state->puzzle_id) != 0){
+      if(worker->count == worker->capacity){
+        struct replay_state * grown = realloc(worker->states, sizeof(struct replay_state) * worker->capacity * 2);
+        if(grown == NULL){
+          result = SQLITE_NOMEM;
+          break;
+        }
+        worker->states = grown;
+        worker->capacity *= 2;
+      }
+      state = &worker->states[worker->count++];
+      snprintf(state->puzzle_id, MAX_PUZZLE_LEN, "%s", puzzle_id);
+      state->results = 0;
+    }
+
+    replay_result(state, day_number(date), success_arg, worker->algorithm);
+  }
+
+  if(result != SQLITE_DONE){
+    printf("ERROR replaying results: %s\n", result == SQLITE_NOMEM ? "out of memory" : sqlite3_errmsg(dbc));
+    worker->failed = 1;
+  }
+
+  sqlite3_finalize(replay_stmt);
+  sqlite3_close(dbc);
+
+  return NULL;
+
+}
+
+/* free_reschedule_workers frees the first <count> reschedule workers and
+ * what they replayed */
+void free_reschedule_workers(struct reschedule_worker * workers, int count) {
+
+  for(int i = 0; i < count; i++) {
+    free(workers[i].states);
+  }
+  free(workers);
+
+}
+
+/* reschedule_deck recomputes every puzzle's score and next test date from its
+ * history under <algorithm>.  The write lock is taken before the deck is
+ * read, so the ids and every result the threads replay come from the same
+ * state of the database.  The deck is split by puzzle_id into contiguous
+ * ranges replayed in parallel by replay_partition, each through its own
+ * read-only connection, then this thread saves the puzzles whose schedule
+ * changed and the algorithm, so later results use it, in that one
+ * transaction.  With dry_run the transaction is rolled back after printing
+ * the future histogram before and after */
+void reschedule_deck(int algorithm, int dry_run) {
+
+  sqlite3 * dbc = get_db_conn();
+  sqlite3_stmt * puzzle_ids_stmt;
+  sqlite3_stmt * reschedule_stmt;
+  char today[11];
+  get_today(today);
+
+  // The threads' connections cannot see uncommitted changes, so results
+  // drained from the spool by begin_write are committed before replaying
+  int result = begin_write(dbc);
+  while(result == SQLITE_OK && spool_consumed > 0){
+    result = commit_write(dbc);
+    if(result == SQLITE_OK){
+      result = begin_write(dbc);
+    }
+  }
+  if(result != SQLITE_OK){
+    printf("ERROR rescheduling: %s\n", sqlite3_errmsg(dbc));
+    release_db_conn(dbc);
+    return;
+  }
+
+  int puzzle_count = 0;
+  int puzzle_capacity = 1024;
+  char (*puzzle_ids)[MAX_PUZZLE_LEN] = malloc(sizeof(*puzzle_ids) * puzzle_capacity);
+
+  result = puzzle_ids == NULL ? SQLITE_NOMEM : sqlite3_prepare_v2(dbc, get_all_puzzle_ids_statement, strlen(get_all_puzzle_ids_statement), &puzzle_ids_stmt, NULL);
+  if(result == SQLITE_OK){
+    while((result = sqlite3_step(puzzle_ids_stmt)) == SQLITE_ROW){
+      if(puzzle_count == puzzle_capacity){
+        char (*grown)[MAX_PUZZLE_LEN] = realloc(puzzle_ids, sizeof(*puzzle_ids) * puzzle_capacity * 2);
+        if(grown == NULL){
+          result = SQLITE_NOMEM;
+          break;
+        }
+        puzzle_ids = grown;
+        puzzle_capacity *= 2;
+      }
+      snprintf(puzzle_ids[puzzle_count++], MAX_PUZZLE_LEN, "%s", (const char *)sqlite3_column_text(puzzle_ids_stmt,0));
+    }
+    sqlite3_finalize(puzzle_ids_stmt);
+  }
+
+  int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+  if(thread_count > RESCHEDULE_MAX_THREADS){
+    thread_count = RESCHEDULE_MAX_THREADS;
+  }
+  if(thread_count > puzzle_count){
+    thread_count = puzzle_count;
+  }
+  if(thread_count < 1){
+    thread_count = 1;
+  }
+
+  struct reschedule_worker * workers = result == SQLITE_DONE ? calloc(thread_count, sizeof(struct reschedule_worker)) : NULL;
+  if(workers == NULL){
+    printf("ERROR rescheduling: %s\n", result == SQLITE_DONE || result == SQLITE_NOMEM ? "out of memory" : sqlite3_errmsg(dbc));
+    free(puzzle_ids);
+    rollback_write(dbc);
+    release_db_conn(dbc);
+    return;
+  }
+
+  int started = 0;
+  int failed = 0;
+  for(int i = 0; i < thread_count && puzzle_count > 0; i++) {
+    strcpy(workers[i].first_puzzle_id, puzzle_ids[(long)i * puzzle_count / thread_count]);
+    strcpy(workers[i].last_puzzle_id, puzzle_ids[(long)(i + 1) * puzzle_count / thread_count - 1]);
+    strcpy(workers[i].today, today);
+    workers[i].algorithm = algorithm;
+    if(pthread_create(&workers[i].thread, NULL, replay_partition, &workers[i]) != 0){
+      printf("ERROR starting reschedule thread\n");
+      failed = 1;
+      break;
+    }
+    started++;
+  }
+
+  for(int i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+    failed = failed || workers[i].failed;
+  }
+
+  free(puzzle_ids);
+
+  if(failed){
+    printf("ERROR rescheduling - nothing was changed\n");
+    free_reschedule_workers(workers, thread_count);
+    rollback_write(dbc);
+    release_db_conn(dbc);
+    return;
+  }
+
+  if(dry_run){
+    printf("BEFORE\n");
+    print_due_histogram(dbc);
+  }
+
+  int replayed = 0;
+  int changed = 0;
+  result = sqlite3_prepare_v2(dbc, reschedule_puzzle_statement, strlen(reschedule_puzzle_statement), &reschedule_stmt, NULL);
+  for(int i = 0; result == SQLITE_OK && i < started; i++) {
+    for(int j = 0; j < workers[i].count; j++) {
+      struct replay_state * state = &workers[i].states[j];
+      char next_test_day[11];
+      day_from_number(next_test_day, state->next_day);
+
+      sqlite3_reset(reschedule_stmt);
+      sqlite3_bind_int(reschedule_stmt,1,state->score);
+      sqlite3_bind_text(reschedule_stmt,2,next_test_day,strlen(next_test_day),SQLITE_TRANSIENT);
+      sqlite3_bind_text(reschedule_stmt,3,state->puzzle_id,strlen(state->puzzle_id),SQLITE_TRANSIENT);
+      if(sqlite3_step(reschedule_stmt) != SQLITE_DONE){
+        printf("ERROR rescheduling puzzle %s: %s\n", state->puzzle_id, sqlite3_errmsg(dbc));
+        result = SQLITE_ERROR;
+        break;
+      }
+      changed += sqlite3_changes(dbc);
+      replayed++;
+    }
+  }
+  sqlite3_finalize(reschedule_stmt);
+  free_reschedule_workers(workers, thread_count);
+
+  if(result == SQLITE_OK && !dry_run){
+    result = set_setting(dbc, "main", "algorithm", algorithm_names[algorithm]);
+  }
+
+  if(result != SQLITE_OK){
+    printf("ERROR rescheduling - nothing was changed\n");
+    rollback_write(dbc);
+    release_db_conn(dbc);
+    return;
+  }
+
+  if(dry_run){
+    printf("AFTER\n");
+    print_due_histogram(dbc);
+    rollback_write(dbc);
+  } else if(commit_write(dbc) != SQLITE_OK) {
+    printf("ERROR rescheduling - nothing was changed: %s\n", sqlite3_errmsg(dbc));
+    release_db_conn(dbc);
+    return;
+  }
+
+  printf("RESCHEDULED: %d puzzles with %s using %d threads\nCHANGED: %d\n", replayed, algorithm_names[algorithm], thread_count, changed);
+
+  release_db_conn(dbc);
+
+}
+
+/* get_shuffle_multiplier returns the multiplier of the random order's shuffle
+ * for a seed.  Seed 0 gives 48271, the order used before seeds existed, and
+ * since 2^31 - 1 is prime every seed gives a permutation of the ids */
+long long get_shuffle_multiplier(unsigned long long seed) {
+
+  return (48271LL * (long long)(seed % 2147483646ULL + 1)) % 2147483647LL;
+
+}
+
+/* shuffle_deck takes a seed, remembers it and its multiplier in the settings
+ * table (for puzzles added later) and rekeys every puzzle in the random order
+ * with it in one transaction */
+void shuffle_deck(unsigned long long seed) {
+
+  sqlite3 * dbc = get_db_conn();
+  sqlite3_stmt * shuffle_stmt;
+  char seed_value[21];
+  char multiplier_value[21];
+  long long multiplier = get_shuffle_multiplier(seed);
+  snprintf(seed_value, sizeof(seed_value), "%llu", seed);
+  snprintf(multiplier_value, sizeof(multiplier_value), "%lld", multiplier);
+
+  if(begin_write(dbc) != SQLITE_OK){
+    printf("ERROR shuffling puzzles: %s\n", sqlite3_errmsg(dbc));
+    release_db_conn(dbc);
+    return;
+  }
+
+  set_setting(dbc, "main", "shuffle_seed", seed_value);
+  set_setting(dbc, "main", "shuffle_multiplier", multiplier_value);
+
+  sqlite3_prepare_v2(dbc, set_shuffle_keys_statement, strlen(set_shuffle_keys_statement), &shuffle_stmt, NULL);
+  sqlite3_bind_int64(shuffle_stmt,1,multiplier);
+  if(sqlite3_step(shuffle_stmt) != SQLITE_DONE){
+    printf("ERROR shuffling puzzles: %s\n", sqlite3_errmsg(dbc));
+    sqlite3_finalize(shuffle_stmt);
+    rollback_write(dbc);
+    release_db_conn(dbc);
+    return;
+  }
+  int shuffled = sqlite3_changes(dbc);
+  sqlite3_finalize(shuffle_stmt);
+
+  if(commit_write(dbc) != SQLITE_OK){
+    printf("ERROR shuffling puzzles: %s\n", sqlite3_errmsg(dbc));
+  } else {
+    printf("SHUFFLED: %d puzzles with seed %s\n", shuffled, seed_value);
+  }
+
+  release_db_conn(dbc);
+
+}
+
+/* The snapshot_delta VFS wraps the default VFS for the destination of a
+ * snapshot.  Writes to the database file are compared with what is already on
+ * disk and skipped when identical, so refreshing a copy of the last snapshot
+ * only rewrites the pages that changed since it was taken */
+struct delta_file {
+  sqlite3_file base;
+  sqlite3_file * real;
+  int is_main_db;
+};
+
+sqlite3_vfs delta_vfs;
+sqlite3_io_methods delta_io_methods;
+long delta_pages_written = 0;
+long delta_pages_skipped = 0;
+
+int delta_close(sqlite3_file * file) {
+  struct delta_file * delta = (struct delta_file *)file;
+  return delta->real->pMethods->xClose(delta->real);
+}
+
+int delta_read(sqlite3_file * file, void * buffer, int amount, sqlite3_int64 offset) {
+  struct delta_file * delta = (struct delta_file *)file;
+  return delta->real->pMethods->xRead(delta->real, buffer, amount, offset);
+}
+
+int delta_write(sqlite3_file * file, const void * buffer, int amount, sqlite3_int64 offset) {
+
+  struct delta_file * delta = (struct delta_file *)file;
+
+  if(delta->is_main_db){
+    char * existing = malloc(amount);
+    if(existing == NULL){
+      return SQLITE_IOERR_NOMEM;
+    }
+    int rc = delta->real->pMethods->xRead(delta->real, existing, amount, offset);
+    int same = rc == SQLITE_OK && memcmp(existing, buffer, amount) == 0;
+    free(existing);
+
+    if(same){
+      delta_pages_skipped++;
+      return SQLITE_OK;
+    }
+    delta_pages_written++;
+  }
+
+  return delta->real->pMethods->xWrite(delta->real, buffer, amount, offset);
+
+}
+
+int delta_truncate(sqlite3_file * file, sqlite3_int64 size) {
+  struct delta_file * delta = (struct delta_file *)file;
+  return delta->real->pMethods->xTruncate(delta->real, size);
+}
+
+int delta_sync(sqlite3_file * file, int flags) {
+  struct delta_file * delta = (struct delta_file *)file;
+  return delta->real->pMethods->xSync(delta->real, flags);
+}
+
+int delta_file_size(sqlite3_file * file, sqlite3_int64 * size) {
+  struct delta_file * delta = (struct delta_file *)file;
+  return delta->real->pMethods->xFileSize(delta->real, size);
+}
+
+int delta_lock(sqlite3_file * file, int lock) {
+  struct delta_file * delta = (struct delta_file *)file;
+  return delta->real->pMethods->xLock(delta->real, lock);
+}
+
+int delta_unlock(sqlite3_file * file, int lock) {
+  struct delta_file * delta = (struct delta_file *)file;
+  return delta->real->pMethods->xUnlock(delta->real, lock);
+}
+
+int delta_check_reserved_lock(sqlite3_file * file, int * reserved) {
+  struct delta_file * delta = (struct delta_file *)file;
+  return delta->real->pMethods->xCheckReservedLock(delta->real, reserved);
+}
+
+int delta_file_control(sqlite3_file * file, int op, void * arg) {
+  struct delta_file * delta = (struct delta_file *)file;
+  return delta->real->pMethods->xFileControl(delta->real, op, arg);
+}
+
+int delta_sector_size(sqlite3_file * file) {
+  struct delta_file * delta = (struct delta_file *)file;
+  return delta->real->pMethods->xSectorSize(delta->real);
+}
+
+int delta_device_characteristics(sqlite3_file * file) {
+  struct delta_file * delta = (struct delta_file *)file;
+  return delta->real->pMethods->xDeviceCharacteristics(delta->real);
+}
+
+int delta_open(sqlite3_vfs * vfs, const char * name, sqlite3_file * file, int flags, int * out_flags) {
+
+  sqlite3_vfs * root = vfs->pAppData;
+  struct delta_file * delta = (struct delta_file *)file;
+
+  delta->real = (sqlite3_file *)&delta[1];
+  delta->is_main_db = (flags & SQLITE_OPEN_MAIN_DB) != 0;
+
+  int rc = root->xOpen(root, name, delta->real, flags, out_flags);
+  delta->base.pMethods = delta->real->pMethods != NULL ? &delta_io_methods : NULL;
+
+  return rc;
+
+}
+
+/* register_delta_vfs sets up and registers the snapshot_delta VFS on top of
+ * the default VFS the first time it is called */
+void register_delta_vfs() {
+
+  if(delta_io_methods.iVersion != 0){
+    return;
+  }
+
+  sqlite3_vfs * root = sqlite3_vfs_find(NULL);
+
+  delta_vfs = *root;
+  delta_vfs.zName = "snapshot_delta";
+  delta_vfs.pNext = NULL;
+  delta_vfs.pAppData = root;
+  delta_vfs.szOsFile = sizeof(struct delta_file) + root->szOsFile;
+  delta_vfs.xOpen = delta_open;
+
+  delta_io_methods.iVersion = 1;
+  delta_io_methods.xClose = delta_close;
+  delta_io_methods.xRead = delta_read;
+  delta_io_methods.xWrite = delta_write;
+  delta_io_methods.xTruncate = delta_truncate;
+  delta_io_methods.xSync = delta_sync;
+  delta_io_methods.xFileSize = delta_file_size;
+  delta_io_methods.xLock = delta_lock;
+  delta_io_methods.xUnlock = delta_unlock;
+  delta_io_methods.xCheckReservedLock = delta_check_reserved_lock;
+  delta_io_methods.xFileControl = delta_file_control;
+  delta_io_methods.xSectorSize = delta_sector_size;
+  delta_io_methods.xDeviceCharacteristics = delta_device_characteristics;
+
+  sqlite3_vfs_register(&delta_vfs, 0);
+
+}
+
+/* copy_file copies the file <from> to <to>, replacing it, and syncs the copy.
+ * Returns 0, or -1 with errno set */
+int copy_file(const char * from, const char * to) {
+
+  char buffer[65536];
+  ssize_t len = 0;
+  int in = open(from, O_RDONLY);
+  if(in < 0){
+    return -1;
+  }
+  int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(out < 0){
+    close(in);
+    return -1;
+  }
+
+  while((len = read(in, buffer, sizeof(buffer))) > 0){
+    if(write(out, buffer, len) != len){
+      len = -1;
+      break;
+    }
+  }
+  int result = len == 0 && fsync(out) == 0 ? 0 : -1;
+  int saved_errno = errno;
+  close(in);
+  close(out);
+  errno = saved_errno;
+
+  return result;
+
+}
+
+/* replace_file syncs the finished file <from> and renames it over <to>,
+ * syncing the directory so the rename survives a crash.  Returns 0, or -1
+ * with errno set */
+int replace_file(const char * from, const char * to) {
+
+  int fd = open(from, O_RDWR);
+  if(fd < 0 || fsync(fd) != 0){
+    if(fd >= 0){
+      close(fd);
+    }
+    return -1;
+  }
+  close(fd);
+
+  if(rename(from, to) != 0){
+    return -1;
+  }
+
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", to);
+  char * slash = strrchr(dir, '/');
+  if(slash == NULL){
+    strcpy(dir, ".");
+  } else if(slash == dir) {
+    dir[1] = '\0';
+  } else {
+    *slash = '\0';
+  }
+  int dir_fd = open(dir, O_RDONLY);
+  if(dir_fd >= 0){
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+
+  return 0;
+
+}
+
+/* snapshot_database copies the database to <dest> while other invocations
+ * keep using it.  The copy is made with the sqlite3 backup API
+ * SNAPSHOT_PAGES_PER_STEP pages at a time, pausing SNAPSHOT_STEP_PAUSE_MS
+ * between steps so the source is only ever locked for one short step.  If
+ * the database changes between steps the backup API starts over, so the
+ * snapshot is always consistent.  The backup is written to <dest>.tmp - which
+ * starts as a copy of the last snapshot, if any, and is written through the
+ * snapshot_delta VFS so only changed pages are rewritten - and only renamed
+ * over <dest> once it is complete and synced, so an interrupted snapshot
+ * never damages the previous one */
+void snapshot_database(char * dest) {
+
+  sqlite3 * dbc = get_db_conn();
+  sqlite3 * dest_dbc = 0;
+  char tmp[PATH_MAX];
+  struct stat st;
+
+  register_delta_vfs();
+  delta_pages_written = 0;
+  delta_pages_skipped = 0;
+
+  if(snprintf(tmp, sizeof(tmp), "%s.tmp", dest) >= (int)sizeof(tmp)){
+    printf("ERROR opening snapshot %s: path too long\n", dest);
+    release_db_conn(dbc);
+    return;
+  }
+  unlink(tmp); // left by an interrupted snapshot
+  if(stat(dest, &st) == 0 && copy_file(dest, tmp) != 0){
+    printf("ERROR copying snapshot %s to %s: %s\n", dest, tmp, strerror(errno));
+    unlink(tmp);
+    release_db_conn(dbc);
+    return;
+  }
+
+  if(sqlite3_open_v2(tmp, &dest_dbc, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "snapshot_delta") != SQLITE_OK){
+    printf("ERROR opening snapshot %s: %s\n", tmp, sqlite3_errmsg(dest_dbc));
+    sqlite3_close(dest_dbc);
+    unlink(tmp);
+    release_db_conn(dbc);
+    return;
+  }
+  sqlite3_exec(dest_dbc, snapshot_journal_mode_statement, NULL, NULL, NULL); // the file is scratch until it is renamed
+
+  sqlite3_backup * backup = sqlite3_backup_init(dest_dbc, "main", dbc, "main");
+  if(backup == NULL){
+    printf("ERROR starting snapshot: %s\n", sqlite3_errmsg(dest_dbc));
+    sqlite3_close(dest_dbc);
+    unlink(tmp);
+    release_db_conn(dbc);
+    return;
+  }
+
+  int steps = 0;
+  int result;
+  do {
+    result = sqlite3_backup_step(backup, SNAPSHOT_PAGES_PER_STEP);
+    steps++;
+    if(result == SQLITE_OK || result == SQLITE_BUSY || result == SQLITE_LOCKED){
+      sqlite3_sleep(SNAPSHOT_STEP_PAUSE_MS);
+    }
+  } while(result == SQLITE_OK || result == SQLITE_BUSY || result == SQLITE_LOCKED);
+
+  int page_count = sqlite3_backup_pagecount(backup);
+  sqlite3_backup_finish(backup);
+  if(sqlite3_close(dest_dbc) != SQLITE_OK && result == SQLITE_DONE){
+    result = SQLITE_IOERR;
+  }
+
+  if(result != SQLITE_DONE){
+    printf("ERROR taking snapshot: %s\n", sqlite3_errstr(result));
+    unlink(tmp);
+  } else if(replace_file(tmp, dest) != 0) {
+    printf("ERROR saving snapshot %s: %s\n", dest, strerror(errno));
+    unlink(tmp);
+  } else {
+    printf("SNAPSHOT: %s\nPAGES: %d\nSTEPS: %d\nWRITTEN: %ld\nUNCHANGED: %ld\n", dest, page_count, steps, delta_pages_written, delta_pages_skipped);
+  }
+
+  release_db_conn(dbc);
+
+}
+
+/* copy_synced_results copies the results in schema <source> that schema
+ * <dest> has not seen into <dest>, returning how many were added.  Only rows
+ * past dest's high-water mark for source are read, rows that started out in
+ * dest are skipped and rows already copied by way of a third database are
+ * dropped by results_origin_idx.  The puzzles touched are noted in
+ * temp.synced_puzzles for reschedule_synced_puzzles */
+int copy_synced_results(sqlite3 * dbc, const char * source, const char * source_id, const char * dest, const char * dest_id, sqlite3_int64 high_water) {
+
+  sqlite3_stmt * find_stmt;
+  sqlite3_stmt * copy_stmt;
+
+  char * find_statement = sqlite3_mprintf(find_synced_puzzles_statement, source);
+  sqlite3_prepare_v2(dbc, find_statement, -1, &find_stmt, NULL);
+  sqlite3_free(find_statement);
+  sqlite3_bind_text(find_stmt,1,dest,strlen(dest),NULL);
+  sqlite3_bind_int64(find_stmt,2,high_water);
+  sqlite3_bind_text(find_stmt,3,source_id,strlen(source_id),NULL);
+  sqlite3_bind_text(find_stmt,4,dest_id,strlen(dest_id),NULL);
+  int result = sqlite3_step(find_stmt);
+  sqlite3_finalize(find_stmt);
+  if(result != SQLITE_DONE){
+    printf("ERROR finding results to sync: %s\n", sqlite3_errmsg(dbc));
+    return -1;
+  }
+
+  char * copy_statement = sqlite3_mprintf(copy_synced_results_statement, dest, source);
+  sqlite3_prepare_v2(dbc, copy_statement, -1, &copy_stmt, NULL);
+  sqlite3_free(copy_statement);
+  sqlite3_bind_text(copy_stmt,1,source_id,strlen(source_id),NULL);
+  sqlite3_bind_int64(copy_stmt,2,high_water);
+  sqlite3_bind_text(copy_stmt,3,dest_id,strlen(dest_id),NULL);
+  result = sqlite3_step(copy_stmt);
+  sqlite3_finalize(copy_stmt);
+  if(result != SQLITE_DONE){
+    printf("ERROR copying results: %s\n", sqlite3_errmsg(dbc));
+    return -1;
+  }
+
+  return sqlite3_changes(dbc);
+
+}
+
+/* reschedule_synced_puzzles replays the history of every puzzle sync touched
+ * in schema <schema> under that database's interval algorithm, adding the
+ * puzzle if the database had not seen it before.  Returns the number of
+ * puzzles rescheduled */
+int reschedule_synced_puzzles(sqlite3 * dbc, const char * schema) {
+
+  sqlite3_stmt * synced_stmt;
+  sqlite3_stmt * update_stmt;
+  sqlite3_stmt * insert_stmt;
+  int algorithm = get_schedule_algorithm(dbc, schema);
+  int rescheduled = 0;
+
+  char * update_statement = sqlite3_mprintf(update_synced_puzzle_statement, schema);
+  char * insert_statement = sqlite3_mprintf(insert_synced_puzzle_statement, schema);
+  sqlite3_prepare_v2(dbc, update_statement, -1, &update_stmt, NULL);
+  sqlite3_prepare_v2(dbc, insert_statement, -1, &insert_stmt, NULL);
+  sqlite3_free(update_statement);
+  sqlite3_free(insert_statement);
+
+  sqlite3_prepare_v2(dbc, get_synced_puzzles_statement, strlen(get_synced_puzzles_statement), &synced_stmt, NULL);
+  sqlite3_bind_text(synced_stmt,1,schema,strlen(schema),NULL);
+
+  while(sqlite3_step(synced_stmt) == SQLITE_ROW){
+    struct replay_state state;
+    char puzzle_id[MAX_PUZZLE_LEN];
+    snprintf(puzzle_id, MAX_PUZZLE_LEN, "%s", (const char *)sqlite3_column_text(synced_stmt,0));
+
+    replay_puzzle_history(dbc, schema, puzzle_id, &state, algorithm);
+    if(state.results == 0){
+      continue;
+    }
+
+    char next_test_day[11];
+    day_from_number(next_test_day, state.next_day);
+
+    sqlite3_reset(update_stmt);
+    sqlite3_bind_int(update_stmt,1,state.score);
+    sqlite3_bind_text(update_stmt,2,next_test_day,strlen(next_test_day),SQLITE_TRANSIENT);
+    sqlite3_bind_text(update_stmt,3,puzzle_id,strlen(puzzle_id),SQLITE_TRANSIENT);
+    sqlite3_step(update_stmt);
+
+    if(sqlite3_changes(dbc) == 0){
+      sqlite3_reset(insert_stmt);
+      sqlite3_bind_text(insert_stmt,1,puzzle_id,strlen(puzzle_id),SQLITE_TRANSIENT);
+      sqlite3_bind_int(insert_stmt,2,state.score);
+      sqlite3_bind_text(insert_stmt,3,next_test_day,strlen(next_test_day),SQLITE_TRANSIENT);
+      if(sqlite3_step(insert_stmt) != SQLITE_DONE){
+        printf("ERROR adding synced puzzle %s: %s\n", puzzle_id, sqlite3_errmsg(dbc));
+      }
+    }
+
+    rescheduled++;
+  }
+
+  sqlite3_finalize(synced_stmt);
+  sqlite3_finalize(update_stmt);
+  sqlite3_finalize(insert_stmt);
+
+  return rescheduled;
+
+}
+
+/* get_max_result_id returns the highest results id in schema <schema> */
+sqlite3_int64 get_max_result_id(sqlite3 * dbc, const char * schema) {
+
+  sqlite3_stmt * max_id_stmt;
+  sqlite3_int64 max_id = 0;
+
+  char * max_id_statement = sqlite3_mprintf(get_max_result_id_statement, schema);
+  sqlite3_prepare_v2(dbc, max_id_statement, -1, &max_id_stmt, NULL);
+  sqlite3_free(max_id_statement);
+  if(sqlite3_step(max_id_stmt) == SQLITE_ROW){
+    max_id = sqlite3_column_int64(max_id_stmt, 0);
+  }
+  sqlite3_finalize(max_id_stmt);
+
+  return max_id;
+
+}
+
+/* sync_database merges the results of the database at <path> with this one
+ * in both directions.  Each database keeps a high-water mark on the other's
+ * results.id (the "sync:<db_id>" setting), so only rows added since the last
+ * sync are read, and the puzzles those rows touch are rescheduled from their
+ * full history.  Everything happens in one transaction across both files.
+ * Deleting a puzzle is not synced - the other side's results bring it back */
+void sync_database(char * path) {
+
+  if(sandbox_mode){
+    printf("sync is not available with --sandbox since it writes to %s\n", path);
+    return;
+  }
+
+  char error[200];
+  sqlite3 * other_dbc = open_database(path, error, sizeof(error));
+  if(other_dbc == NULL){
+    printf("ERROR %s %s\n", path, error);
+    return;
+  }
+  sqlite3_close(other_dbc); // opened only to bring its schema up to date
+
+  sqlite3 * dbc = get_db_conn();
+  sqlite3_stmt * attach_stmt;
+  char local_id[40], other_id[40];
+  char local_key[50], other_key[50];
+  char high_water_value[30];
+
+  sqlite3_prepare_v2(dbc, attach_sync_database_statement, strlen(attach_sync_database_statement), &attach_stmt, NULL);
+  sqlite3_bind_text(attach_stmt,1,path,strlen(path),NULL);
+  int result = sqlite3_step(attach_stmt);
+  sqlite3_finalize(attach_stmt);
+  if(result != SQLITE_DONE){
+    printf("ERROR attaching %s: %s\n", path, sqlite3_errmsg(dbc));
+    release_db_conn(dbc);
+    return;
+  }
+
+  get_setting(dbc, "main", "db_id", local_id, sizeof(local_id), "");
+  get_setting(dbc, "other", "db_id", other_id, sizeof(other_id), "");
+  if(strcmp(local_id, other_id) == 0){
+    printf("ERROR %s is this database or a copy of it\n", path);
+    release_db_conn(dbc);
+    return;
+  }
+  sprintf(local_key, "sync:%s", other_id);
+  sprintf(other_key, "sync:%s", local_id);
+
+  sqlite3_exec(dbc, create_synced_puzzles_table, NULL, NULL, NULL);
+  sqlite3_exec(dbc, begin_transaction_statement, NULL, NULL, NULL);
+
+  get_setting(dbc, "main", local_key, high_water_value, sizeof(high_water_value), "0");
+  int pulled = copy_synced_results(dbc, "other", other_id, "main", local_id, atoll(high_water_value));
+
+  get_setting(dbc, "other", other_key, high_water_value, sizeof(high_water_value), "0");
+  int pushed = pulled < 0 ? -1 : copy_synced_results(dbc, "main", local_id, "other", other_id, atoll(high_water_value));
+
+  if(pushed < 0){
+    sqlite3_exec(dbc, rollback_transaction_statememt, NULL, NULL, NULL);
+    release_db_conn(dbc);
+    return;
+  }
+
+  int local_rescheduled = reschedule_synced_puzzles(dbc, "main");
+  int other_rescheduled = reschedule_synced_puzzles(dbc, "other");
+
+  sprintf(high_water_value, "%lld", get_max_result_id(dbc, "other"));
+  set_setting(dbc, "main", local_key, high_water_value);
+  sprintf(high_water_value, "%lld", get_max_result_id(dbc, "main"));
+  set_setting(dbc, "other", other_key, high_water_value);
+
+  if(sqlite3_exec(dbc, commit_transaction_statement, NULL, NULL, NULL) != SQLITE_OK){
+    printf("ERROR saving sync: %s\n", sqlite3_errmsg(dbc));
+    sqlite3_exec(dbc, rollback_transaction_statememt, NULL, NULL, NULL);
+    release_db_conn(dbc);
+    return;
+  }
+
+  sqlite3_exec(dbc, detach_sync_database_statement, NULL, NULL, NULL);
+  release_db_conn(dbc);
+
+  printf("PULLED: %d results, %d puzzles rescheduled\nPUSHED: %d results, %d puzzles rescheduled\n", pulled, local_rescheduled, pushed, other_rescheduled);
+
+}
+
+/* collect_databases adds every file under dir, recursively, whose name ends in
+ * .sqlite to the pool's jobs */
+void collect_databases(const char * dir, struct maintain_pool * pool) {
+
+  DIR * dh = opendir(dir);
+  if(dh == NULL){
+    printf("ERROR reading %s: %s\n", dir, strerror(errno));
+    return;
+  }
+
+  struct dirent * entry;
+  while((entry = readdir(dh)) != NULL){
+    if(entry->d_name[0] == '.'){
+      continue;
+    }
+
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    if(lstat(path, &st) != 0){
+      continue;
+    }
+
+    if(S_ISDIR(st.st_mode)){
+      collect_databases(path, pool);
+      continue;
+    }
+
+    int len = strlen(entry->d_name);
+    if(!S_ISREG(st.st_mode) || len < 7 || strcmp(entry->d_name + len - 7, ".sqlite") != 0){
+      continue;
+    }
+
+    if(pool->count == pool->capacity){
+      struct maintain_job * jobs = realloc(pool->jobs, sizeof(struct maintain_job) * pool->capacity * 2);
+      if(jobs == NULL){
+        printf("ERROR reading %s: out of memory for more than %d databases\n", dir, pool->count);
+        break;
+      }
+      pool->jobs = jobs;
+      pool->capacity *= 2;
+    }
+    memset(&pool->jobs[pool->count], 0, sizeof(struct maintain_job));
+    snprintf(pool->jobs[pool->count++].path, PATH_MAX, "%s", path);
+  }
+
+  closedir(dh);
+
+}
+
+int compare_maintain_jobs(const void * a, const void * b) {
+  return strcmp(((const struct maintain_job *)a)->path, ((const struct maintain_job *)b)->path);
+}
+
+/* get_pragma_int returns the integer a pragma statement reports, or -1 */
+int get_pragma_int(sqlite3 * dbc, const char * statement) {
+
+  sqlite3_stmt * stmt;
+  int value = -1;
+
+  sqlite3_prepare_v2(dbc, statement, strlen(statement), &stmt, NULL);
+  if(sqlite3_step(stmt) == SQLITE_ROW){
+    value = sqlite3_column_int(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+
+  return value;
+
+}
+
+/* maintain_database brings one database up to date and tidies it: open_database
+ * runs any schema migrations, then it is checked for corruption, its query
+ * planner statistics are refreshed and its free pages are handed back to the
+ * file system.  A database that fails its check is left untouched.  Free pages
+ * are released <pages> at a time with a pause of <pause_ms> between steps,
+ * each step its own short transaction, so the learner using the database is
+ * never held up for long.  A database not yet in incremental auto_vacuum mode
+ * is switched over with one full VACUUM, but only once a
+ * MAINTAIN_VACUUM_FREE_PERCENT share of it is free */
+void maintain_database(struct maintain_job * job, int pages, int pause_ms, int quick) {
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  sqlite3 * dbc = open_database(job->path, job->message, sizeof(job->message));
+  if(dbc == NULL){
+    job->failed = 1;
+    job->duration_ms = get_elapsed_us(&start) / 1000;
+    return;
+  }
+
+  sqlite3_stmt * check_stmt;
+  const char * check_statement = quick ? quick_check_statement : integrity_check_statement;
+  sqlite3_prepare_v2(dbc, check_statement, strlen(check_statement), &check_stmt, NULL);
+  if(sqlite3_step(check_stmt) != SQLITE_ROW){
+    job->failed = 1;
+    snprintf(job->message, sizeof(job->message), "check failed: %s", sqlite3_errmsg(dbc));
+  } else if(strcmp((const char *)sqlite3_column_text(check_stmt, 0), "ok") != 0) {
+    job->failed = 1;
+    snprintf(job->message, sizeof(job->message), "corrupt: %s", (const char *)sqlite3_column_text(check_stmt, 0));
+    for(char * pch = strchr(job->message, '\n'); pch != NULL; pch = strchr(pch, '\n')) {
+      *pch = ' ';
+    }
+  }
+  sqlite3_finalize(check_stmt);
+
+  if(job->failed){
+    sqlite3_close(dbc);
+    job->duration_ms = get_elapsed_us(&start) / 1000;
+    return;
+  }
+
+  char * error_message = 0;
+  sqlite3_exec(dbc, analyze_statement, NULL, NULL, &error_message);
+  if(error_message != 0){
+    job->failed = 1;
+    snprintf(job->message, sizeof(job->message), "analyze failed: %s", error_message);
+    sqlite3_free(error_message);
+  }
+
+  int free_pages = get_pragma_int(dbc, get_freelist_count_statement);
+  int page_count = get_pragma_int(dbc, get_page_count_statement);
+  char vacuum_step[50];
+  sprintf(vacuum_step, "pragma incremental_vacuum(%d)", pages);
+
+  int auto_vacuum = get_pragma_int(dbc, get_auto_vacuum_statement);
+
+  if(auto_vacuum == MAINTAIN_AUTO_VACUUM_INCREMENTAL){
+    while(!job->failed && free_pages > 0){
+      if(sqlite3_exec(dbc, vacuum_step, NULL, NULL, NULL) != SQLITE_OK){
+        job->failed = 1;
+        snprintf(job->message, sizeof(job->message), "vacuum failed: %s", sqlite3_errmsg(dbc));
+      }
+      free_pages = get_pragma_int(dbc, get_freelist_count_statement);
+      if(free_pages > 0 && pause_ms > 0){
+        poll(NULL, 0, pause_ms);
+      }
+    }
+  } else if(!job->failed && free_pages > 0 && (long)free_pages * 100 >= (long)page_count * MAINTAIN_VACUUM_FREE_PERCENT) {
+    sqlite3_exec(dbc, convert_to_incremental_vacuum_statement, NULL, NULL, &error_message);
+    if(error_message != 0){
+      job->failed = 1;
+      snprintf(job->message, sizeof(job->message), "vacuum failed: %s", error_message);
+      sqlite3_free(error_message);
+    }
+  } else if(!job->failed && auto_vacuum == MAINTAIN_AUTO_VACUUM_NONE) { // say why nothing was reclaimed
+    snprintf(job->message, sizeof(job->message), "auto_vacuum off, %d%% free of the %d%% needed to VACUUM",
+      page_count > 0 ? (int)((long)free_pages * 100 / page_count) : 0, MAINTAIN_VACUUM_FREE_PERCENT);
+  }
+
+  // Measured after the migrations, which may have grown the file
+  job->bytes_reclaimed = (long long)(page_count - get_pragma_int(dbc, get_page_count_statement)) * get_pragma_int(dbc, get_page_size_statement);
+  sqlite3_close(dbc);
+
+  job->duration_ms = get_elapsed_us(&start) / 1000;
+
+}
+
+/* maintain_worker is the body of one maintain thread.  It takes the next
+ * database nobody has claimed until none are left, printing a line for each
+ * as it finishes */
+void * maintain_worker(void * arg) {
+
+  struct maintain_pool * pool = arg;
+
+  while(1){
+    int i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    if(i >= pool->count){
+      return NULL;
+    }
+
+    struct maintain_job * job = &pool->jobs[i];
+    maintain_database(job, pool->pages, pool->pause_ms, pool->quick);
+
+    pthread_mutex_lock(&pool->print_lock);
+    if(job->failed){
+      printf("FAILED: %s %ldms %s\n", job->path, job->duration_ms, job->message);
+    } else {
+      printf("OK: %s %ldms %lld bytes reclaimed%s%s%s\n", job->path, job->duration_ms, job->bytes_reclaimed,
+        strlen(job->message) > 0 ? " (" : "", job->message, strlen(job->message) > 0 ? ")" : "");
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&pool->print_lock);
+
+    if(pool->pause_ms > 0){
+      poll(NULL, 0, pool->pause_ms);
+    }
+  }
+
+}
+
+/* maintain_databases runs maintain_database on every .sqlite file under dir
+ * with a pool of <jobs> threads, each with its own connection, then prints
+ * the totals */
+void maintain_databases(char * dir, int jobs, int pages, int pause_ms, int quick) {
+
+  if(sandbox_mode){
+    printf("maintain is not available with --sandbox since it writes to the databases in %s\n", dir);
+    return;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  struct maintain_pool pool = { 0 };
+  pool.capacity = 64;
+  pool.jobs = malloc(sizeof(struct maintain_job) * pool.capacity);
+  if(pool.jobs == NULL){
+    printf("ERROR maintaining %s: out of memory\n", dir);
+    return;
+  }
+  pool.pages = pages;
+  pool.pause_ms = pause_ms;
+  pool.quick = quick;
+  pthread_mutex_init(&pool.print_lock, NULL);
+
+  collect_databases(dir, &pool);
+  qsort(pool.jobs, pool.count, sizeof(struct maintain_job), compare_maintain_jobs);
+
+  if(jobs > pool.count){
+    jobs = pool.count;
+  }
+
+  // The workers take jobs from the pool until it is empty, so whichever
+  // threads start do all the work, and this thread does it if none can
+  pthread_t * threads = malloc(sizeof(pthread_t) * (jobs > 0 ? jobs : 1));
+  int started = 0;
+  while(threads != NULL && started < jobs && pthread_create(&threads[started], NULL, maintain_worker, &pool) == 0) {
+    started++;
+  }
+  if(started == 0){
+    maintain_worker(&pool);
+  }
+  for(int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  int failed = 0;
+  long long reclaimed = 0;
+  for(int i = 0; i < pool.count; i++) {
+    failed += pool.jobs[i].failed;
+    reclaimed += pool.jobs[i].bytes_reclaimed;
+  }
+
+  printf("FILES: %d\nFAILED: %d\nRECLAIMED: %lld bytes\nDURATION: %.2fs\n", pool.count, failed, reclaimed, get_elapsed_us(&start) / 1e6);
+
+  pthread_mutex_destroy(&pool.print_lock);
+  free(threads);
+  free(pool.jobs);
+
+}
+
+/* run_sandbox_session reads commands from stdin one line at a time and runs
+ * each against the sandbox, so a series of what-if changes can be tried
+ * before it is thrown away.  Options given on a line apply to that line
+ * only */
+void run_sandbox_session() {
+
+  char * line = NULL;
+  size_t line_len = 0;
+
+  while(getline(&line, &line_len, stdin) != -1) {
+    char * args[MAX_SANDBOX_ARGS + 1];
+    int arg_count = 1;
+    args[0] = "nextpuzzle";
+
+    for(char * token = strtok(line, " \t\r\n"); token != NULL && arg_count < MAX_SANDBOX_ARGS; token = strtok(NULL, " \t\r\n")) {
+      args[arg_count++] = token;
+    }
+    args[arg_count] = NULL;
+
+    if(arg_count == 1){
+      continue;
+    }
+
+    char saved_as_of_day[11], saved_queue_order[10], saved_queue_theme[MAX_THEME_LEN];
+    int saved_min_rating = queue_min_rating, saved_max_rating = queue_max_rating;
+    strcpy(saved_as_of_day, as_of_day);
+    strcpy(saved_queue_order, queue_order);
+    strcpy(saved_queue_theme, queue_theme);
+
+    arg_count = parse_global_flags(arg_count, args);
+    if(arg_count > 1){
+      run_command(arg_count, args);
+    }
+    fflush(stdout);
+
+    strcpy(as_of_day, saved_as_of_day);
+    strcpy(queue_order, saved_queue_order);
+    strcpy(queue_theme, saved_queue_theme);
+    queue_min_rating = saved_min_rating;
+    queue_max_rating = saved_max_rating;
+  }
+
+  free(line);
+
+}
+
+/* get_next_due_day takes a database connection and a day in YYYY-MM-DD format
+ * and copies the first later day any puzzle is scheduled for into buffer,
+ * returning false if there is none */
+int get_next_due_day(sqlite3 * dbc, char * day, char * buffer) {
+
+  sqlite3_stmt * next_due_stmt;
+  int found = 0;
+
+  sqlite3_prepare_v2(dbc, get_next_due_day_statement, strlen(get_next_due_day_statement), &next_due_stmt, NULL);
+  sqlite3_bind_text(next_due_stmt,1,day,strlen(day),NULL);
+  if(sqlite3_step(next_due_stmt) == SQLITE_ROW && sqlite3_column_type(next_due_stmt,0) != SQLITE_NULL){
+    strcpy(buffer, (const char *)sqlite3_column_text(next_due_stmt,0));
+    found = 1;
+  }
+  sqlite3_finalize(next_due_stmt);
+
+  return found;
+
+}
+
+/* get_ms_until_day takes a day in YYYY-MM-DD format and returns the number of
+ * milliseconds from now until local midnight at the start of that day */
+long get_ms_until_day(char * day) {
+
+  struct tm midnight;
+  memset(&midnight, 0, sizeof(midnight));
+  sscanf(day, "%d-%d-%d", &midnight.tm_year, &midnight.tm_mon, &midnight.tm_mday);
+  midnight.tm_year -= 1900;
+  midnight.tm_mon -= 1;
+  midnight.tm_isdst = -1;
+
+  double seconds = difftime(mktime(&midnight), time(NULL));
+  return seconds > 0 ? (long)(seconds * 1000) : 0;
+
+}
+
+/* wait_for_change blocks for up to timeout_ms milliseconds (forever if
+ * negative) or until the database file changes.  On Linux the change is
+ * reported by inotify on watch_fd, elsewhere the file's modification time is
+ * checked every WATCH_POLL_MS */
+void wait_for_change(int watch_fd, long timeout_ms) {
+
+#ifdef __linux__
+  if(watch_fd >= 0){
+    struct pollfd watch_poll = { watch_fd, POLLIN, 0 };
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // events for other files in the directory must not restart the timeout,
+    // so each poll only waits out what is left of it
+    while(1){
+      int timeout = -1;
+      if(timeout_ms >= 0){
+        long remaining_ms = timeout_ms - get_elapsed_us(&start) / 1000;
+        if(remaining_ms <= 0){
+          return;
+        }
+        timeout = remaining_ms > INT_MAX ? INT_MAX : (int)remaining_ms;
+      }
+      int ready = poll(&watch_poll, 1, timeout);
+      if(ready < 0){
+        return;
+      }
+      if(ready == 0){
+        continue; // timed out, or a wait longer than INT_MAX needs another poll
+      }
+      char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+      ssize_t len = read(watch_fd, events, sizeof(events));
+      for(char * pch = events; len > 0 && pch < events + len; pch += sizeof(struct inotify_event) + ((struct inotify_event *)pch)->len) {
+        struct inotify_event * event = (struct inotify_event *)pch;
+        if(event->len > 0 && strcmp(event->name, dbfh) == 0){
+          sqlite3_sleep(WATCH_SETTLE_MS); // let the writer finish its transaction
+          return;
+        }
+      }
+    }
+  }
+#endif
+
+  struct stat before, after;
+  stat(dbfh, &before);
+  while(timeout_ms < 0 || timeout_ms > 0){
+    long pause = timeout_ms < 0 || timeout_ms > WATCH_POLL_MS ? WATCH_POLL_MS : timeout_ms;
+    sqlite3_sleep(pause);
+    if(timeout_ms > 0){
+      timeout_ms -= pause;
+    }
+    if(stat(dbfh, &after) == 0 && (after.st_mtime != before.st_mtime || after.st_size != before.st_size)){
+      return;
+    }
+  }
+
+}
+
+/* watch_due_puzzles runs until killed, printing the number of tests remaining
+ * today at start and again whenever it changes.  Rather than polling, it works
+ * out the next day any puzzle falls due and sleeps until midnight of that day,
+ * waking early only when the database file is written.  One connection is
+ * kept open throughout */
+void watch_due_puzzles() {
+
+  sqlite3 * dbc = get_db_conn();
+  int watch_fd = -1;
+  int last_remaining = -1;
+
+#ifdef __linux__
+  watch_fd = inotify_init1(IN_CLOEXEC);
+  if(watch_fd >= 0 && inotify_add_watch(watch_fd, ".", IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0){
+    close(watch_fd);
+    watch_fd = -1;
+  }
+#endif
+
+  while(1) {
+    char today[11];
+    get_today(today);
+
+    int tests_remaining = get_total_tests_for_day(dbc, today);
+    if(tests_remaining != last_remaining){
+      printf("REMAINING: %d\n", tests_remaining);
+      fflush(stdout);
+      last_remaining = tests_remaining;
+    }
+
+    char next_due_day[11];
+    long timeout_ms = -1;
+    if(strlen(as_of_day) == 0){ // with --as-of the day never turns over
+      if(!get_next_due_day(dbc, today, next_due_day)){
+        get_target_day(next_due_day, 1); // still notice overdue puzzles rolling into a new day
+      }
+      timeout_ms = get_ms_until_day(next_due_day) + WATCH_SETTLE_MS;
+    }
+
+    wait_for_change(watch_fd, timeout_ms);
+  }
+
+}
+
+/* plan_entry_before returns true if plan entry a should be worked before b
+ * under the order chosen with --order, matching get_queue_statement */
+int plan_entry_before(struct plan_entry * a, struct plan_entry * b) {
+
+  if(strcmp(queue_order, "score") == 0 && a->score != b->score){
+    return a->score < b->score;
+  }
+
+  if(strcmp(queue_order, "random") == 0){
+    if(a->shuffle_key != b->shuffle_key){
+      return a->shuffle_key < b->shuffle_key;
+    }
+    return a->id < b->id;
+  }
+
+  if(a->day != b->day){
+    return a->day < b->day;
+  }
+
+  return a->id < b->id;
+
+}
+
+/* compare_plan_entries orders plan entries by the day they become due, with
+ * anything overdue counting as due today */
+int compare_plan_entries(const void * a, const void * b) {
+
+  const struct plan_entry * entry_a = a;
+  const struct plan_entry * entry_b = b;
+
+  return (entry_a->planned_day > entry_b->planned_day) - (entry_a->planned_day < entry_b->planned_day);
+
+}
+
+/* plan_heap_push and plan_heap_pop keep heap - an array of pointers into the
+ * plan - as a binary heap with the highest priority entry on top */
+void plan_heap_push(struct plan_entry ** heap, int * heap_size, struct plan_entry * entry) {
+
+  int i = (*heap_size)++;
+  heap[i] = entry;
+
+  while(i > 0 && plan_entry_before(heap[i], heap[(i - 1) / 2])){
+    struct plan_entry * parent = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = heap[i];
+    heap[i] = parent;
+    i = (i - 1) / 2;
+  }
+
+}
+
+struct plan_entry * plan_heap_pop(struct plan_entry ** heap, int * heap_size) {
+
+  struct plan_entry * top = heap[0];
+  heap[0] = heap[--(*heap_size)];
+
+  int i = 0;
+  while(1) {
+    int first = i;
+    int left = 2 * i + 1;
+    int right = 2 * i + 2;
+    if(left < *heap_size && plan_entry_before(heap[left], heap[first])){
+      first = left;
+    }
+    if(right < *heap_size && plan_entry_before(heap[right], heap[first])){
+      first = right;
+    }
+    if(first == i){
+      break;
+    }
+    struct plan_entry * child = heap[first];
+    heap[first] = heap[i];
+    heap[i] = child;
+    i = first;
+  }
+
+  return top;
+
+}
+
+/* plan_budget spreads the schedule so no day from today on has more than
+ * <budget> tests.  Every puzzle is read into memory once, overdue puzzles
+ * count as due today, and the days are swept in order: each day the <budget>
+ * puzzles first in --order priority keep it and the rest roll over to compete
+ * on the next day.  The deck is read and all the moves are written in a
+ * single write transaction.  With dry_run the transaction is rolled back
+ * after printing the future histogram it would produce */
+void plan_budget(int budget, int dry_run) {
+
+  sqlite3 * dbc = get_db_conn();
+  sqlite3_stmt * plan_stmt;
+  sqlite3_stmt * set_date_stmt;
+  char today[11];
+  get_today(today);
+  int today_number = day_number(today);
+
+  int count = 0;
+  int capacity = 1024;
+  struct plan_entry * plan = malloc(sizeof(struct plan_entry) * capacity);
+  if(plan == NULL){
+    printf("ERROR planning budget: out of memory\n");
+    release_db_conn(dbc);
+    return;
+  }
+
+  // The deck is read inside the write transaction so no other writer can
+  // move a puzzle between reading it and writing its planned date
+  sqlite3_exec(dbc, bulk_load_cache_statement, NULL, NULL, NULL);
+  if(begin_write(dbc) != SQLITE_OK){
+    printf("ERROR planning budget: %s\n", sqlite3_errmsg(dbc));
+    free(plan);
+    release_db_conn(dbc);
+    return;
+  }
+
+  int result = sqlite3_prepare_v2(dbc, get_plan_puzzles_statement, strlen(get_plan_puzzles_statement), &plan_stmt, NULL);
+  while(result == SQLITE_OK && (result = sqlite3_step(plan_stmt)) == SQLITE_ROW){
+    if(count == capacity){
+      struct plan_entry * grown = realloc(plan, sizeof(struct plan_entry) * capacity * 2);
+      if(grown == NULL){
+        result = SQLITE_NOMEM;
+        break;
+      }
+      plan = grown;
+      capacity *= 2;
+    }
+    struct plan_entry * entry = &plan[count++];
+    snprintf(entry->puzzle_id, MAX_PUZZLE_LEN, "%s", (const char *)sqlite3_column_text(plan_stmt,0));
+    entry->day = day_number((const char *)sqlite3_column_text(plan_stmt,1));
+    entry->score = sqlite3_column_int(plan_stmt,2);
+    entry->id = sqlite3_column_int64(plan_stmt,3);
+    entry->shuffle_key = sqlite3_column_int64(plan_stmt,4);
+    entry->planned_day = entry->day < today_number ? today_number : entry->day;
+    result = SQLITE_OK;
+  }
+  sqlite3_finalize(plan_stmt);
+
+  struct plan_entry ** heap = result == SQLITE_DONE ? malloc(sizeof(struct plan_entry *) * (count + 1)) : NULL;
+  if(heap == NULL){
+    printf("ERROR planning budget: %s\n", result == SQLITE_DONE || result == SQLITE_NOMEM ? "out of memory" : sqlite3_errmsg(dbc));
+    rollback_write(dbc);
+    free(plan);
+    release_db_conn(dbc);
+    return;
+  }
+
+  qsort(plan, count, sizeof(struct plan_entry), compare_plan_entries);
+
+  int heap_size = 0;
+  int next = 0;
+  int deferred = 0;
+  int last_day = today_number; // the last day with more due than the budget
+
+  for(int day = today_number; next < count || heap_size > 0; day++) {
+    if(heap_size == 0 && plan[next].planned_day > day){
+      day = plan[next].planned_day;
+    }
+    while(next < count && plan[next].planned_day == day){
+      plan_heap_push(heap, &heap_size, &plan[next++]);
+    }
+    for(int kept = 0; kept < budget && heap_size > 0; kept++) {
+      struct plan_entry * entry = plan_heap_pop(heap, &heap_size);
+      if(entry->planned_day != day){
+        entry->planned_day = day;
+        deferred++;
+      }
+    }
+    if(heap_size > 0){
+      last_day = day;
+    }
+  }
+
+  free(heap);
+
+  result = sqlite3_prepare_v2(dbc, set_puzzle_date_statement, strlen(set_puzzle_date_statement), &set_date_stmt, NULL);
+  for(int i = 0; result == SQLITE_OK && i < count; i++) {
+    if(plan[i].planned_day == (plan[i].day < today_number ? today_number : plan[i].day)){
+      continue;
+    }
+    char planned_day[11];
+    day_from_number(planned_day, plan[i].planned_day);
+    sqlite3_reset(set_date_stmt);
+    sqlite3_bind_text(set_date_stmt,1,planned_day,strlen(planned_day),SQLITE_TRANSIENT);
+    sqlite3_bind_text(set_date_stmt,2,plan[i].puzzle_id,strlen(plan[i].puzzle_id),SQLITE_TRANSIENT);
+    if(sqlite3_step(set_date_stmt) != SQLITE_DONE){
+      printf("ERROR setting date to %s on puzzle  %s: %s\n", planned_day, plan[i].puzzle_id, sqlite3_errmsg(dbc));
+      result = SQLITE_ERROR;
+    }
+  }
+  sqlite3_finalize(set_date_stmt);
+  free(plan);
+
+  if(result != SQLITE_OK){
+    rollback_write(dbc);
+    release_db_conn(dbc);
+    return;
+  }
+
+  if(dry_run){
+    print_due_histogram(dbc);
+    rollback_write(dbc);
+  } else if(commit_write(dbc) != SQLITE_OK) {
+    printf("ERROR planning budget: %s\n", sqlite3_errmsg(dbc));
+    release_db_conn(dbc);
+    return;
+  }
+
+  char last_day_repr[11];
+  day_from_number(last_day_repr, last_day);
+  printf("DEFERRED: %d\nLAST DAY OVER BUDGET: %s\n", deferred, deferred > 0 ? last_day_repr : "none");
+
+  release_db_conn(dbc);
+
+}
+
+/* get_elapsed_us returns the number of microseconds since start, read from
+ * the monotonic clock */
+long get_elapsed_us(struct timespec * start) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+
+}
+
+/* open_metrics maps the metrics file into memory, creating it if needed.  The
+ * file is shared by every process, which update it with atomic adds, so
+ * recording a metric is a few memory writes and never takes a lock.  Metrics
+ * are best effort: if the file cannot be mapped, or was written by a build
+ * with a different layout, nothing is recorded */
+void open_metrics() {
+
+  int fd = open(metrics_file, O_RDWR | O_CREAT, 0644);
+  if(fd < 0){
+    return;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size > (off_t)sizeof(struct metrics_data)){
+    close(fd);
+    return;
+  }
+
+  // Only ever grow the file - another process may already have it mapped
+  if(st.st_size < (off_t)sizeof(struct metrics_data) && ftruncate(fd, sizeof(struct metrics_data)) != 0){
+    close(fd);
+    return;
+  }
+
+  void * map = mmap(NULL, sizeof(struct metrics_data), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED){
+    return;
+  }
+
+  metrics = map;
+  uint64_t magic = 0;
+  if(!__atomic_compare_exchange_n(&metrics->magic, &magic, METRICS_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && magic != METRICS_MAGIC){
+    close_metrics();
+  }
+
+}
+
+/* close_metrics unmaps the metrics file.  The kernel writes the pages back,
+ * so nothing is lost if this is never called */
+void close_metrics() {
+
+  if(metrics != NULL){
+    munmap(metrics, sizeof(struct metrics_data));
+    metrics = NULL;
+  }
+
+}
+
+/* get_command_metric returns the index into metrics_command_names of the
+ * command run_command will run for these arguments */
+int get_command_metric(int argc, char ** argv) {
+
+  if(argc == 1){
+    return 0;
+  }
+
+  for(int i = 0; i < METRICS_COMMANDS; i++) {
+    if(strcmp(argv[1], metrics_command_names[i]) == 0){
+      return i;
+    }
+  }
+
+  // run_command treats a lone s or f as a batch of one
+  if(argc == 2 && check_success_string_arg(argv[1])){
+    return METRICS_COMMAND_BATCH;
+  }
+
+  if(argc == 2 && check_advance_arg(argv[1])){
+    return METRICS_COMMAND_ADVANCE;
+  }
+
+  return METRICS_COMMAND_RESULT;
+
+}
+
+/* record_histogram adds one observation of us microseconds to a histogram in
+ * the metrics file */
+void record_histogram(struct metrics_histogram * histogram, long us) {
+
+  int bucket = 0;
+  while(bucket < METRICS_BUCKETS && us > metrics_bucket_bounds_us[bucket]){
+    bucket++;
+  }
+
+  __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->sum_us, us, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+
+}
+
+/* record_command_metrics counts a run of command and its end to end latency */
+void record_command_metrics(int command, long us) {
+
+  if(metrics == NULL){
+    return;
+  }
+
+  __atomic_fetch_add(&metrics->command_runs[command], 1, __ATOMIC_RELAXED);
+  record_histogram(&metrics->command_duration[command], us);
+
+}
+
+/* record_db_open_metric records how long get_db_conn took to open and migrate
+ * the database */
+void record_db_open_metric(long us) {
+
+  if(metrics == NULL){
+    return;
+  }
+
+  record_histogram(&metrics->db_open_duration, us);
+
+}
+
+/* count_statement_changes is the profile callback count_changes installs,
+ * run as each statement finishes.  sqlite3_changes only counts the rows the
+ * statement changed itself, not those changed by triggers, but it is left as
+ * it was by statements that change nothing, so it is only read when the
+ * connection's total moved.  Changes are committed once the connection is
+ * back in autocommit mode; discard_statement_changes drops them on rollback */
+int count_statement_changes(unsigned type, void * context, void * stmt, void * elapsed) {
+
+  struct change_count * changes = context;
+  sqlite3 * dbc = sqlite3_db_handle(stmt);
+  int total = sqlite3_total_changes(dbc);
+
+  if(total != changes->total){
+    changes->pending += sqlite3_changes(dbc);
+    changes->total = total;
+  }
+  if(sqlite3_get_autocommit(dbc)){
+    changes->committed += changes->pending;
+    changes->pending = 0;
+  }
+
+  return 0;
+
+}
+
+void discard_statement_changes(void * context) {
+  struct change_count * changes = context;
+  changes->pending = 0;
+}
+
+/* count_changes starts counting the rows dbc's statements commit, for
+ * release_db_conn to add to rows_touched.  Nothing is counted if metrics are
+ * not being recorded */
+void count_changes(sqlite3 * dbc) {
+
+  if(metrics == NULL || metrics_command < 0){
+    return;
+  }
+
+  struct change_count * changes = calloc(1, sizeof(struct change_count));
+  if(changes == NULL){
+    return;
+  }
+  changes->total = sqlite3_total_changes(dbc);
+  sqlite3_trace_v2(dbc, SQLITE_TRACE_PROFILE, count_statement_changes, changes);
+  sqlite3_rollback_hook(dbc, discard_statement_changes, changes);
+
+}
+
+/* record_rows_touched adds the rows a connection inserted, updated or deleted
+ * and committed to the count for the command being run */
+void record_rows_touched(int rows) {
+
+  if(metrics == NULL || metrics_command < 0){
+    return;
+  }
+
+  __atomic_fetch_add(&metrics->rows_touched[metrics_command], rows, __ATOMIC_RELAXED);
+
+}
+
+/* record_result_metric counts <count> results saved now.  They are counted
+ * on the day they were saved by the clock, whatever day --as-of or the spool
+ * recorded them for.  The last METRICS_RESULT_DAYS days are kept in a ring,
+ * each slot packing its day number into the top half of one word and the
+ * count into the bottom half so that moving a slot on to a new day and
+ * counting are one atomic step */
+void record_result_metric(int count) {
+
+  if(metrics == NULL || count <= 0){
+    return;
+  }
+
+  char today[11];
+  time_t now = time(NULL);
+  struct tm local;
+  localtime_r(&now, &local);
+  strftime(today, sizeof(today), dtformat, &local);
+
+  uint64_t day_key = day_number(today);
+  uint64_t * slot = &metrics->results_per_day[day_key % METRICS_RESULT_DAYS];
+  uint64_t seen = __atomic_load_n(slot, __ATOMIC_RELAXED);
+  uint64_t updated;
+
+  do {
+    if(seen >> 32 == day_key){
+      updated = seen + count;
+    } else if(seen >> 32 < day_key) {
+      updated = (day_key << 32) | count;
+    } else {
+      return;
+    }
+  } while(!__atomic_compare_exchange_n(slot, &seen, updated, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+}
+
+/* print_histogram_metric prints one histogram in Prometheus text format, or
+ * as a JSON object */
+void print_histogram_metric(const char * name, const char * labels, struct metrics_histogram * histogram, int json) {
+
+  uint64_t cumulative = 0;
+
+  if(json){
+    printf("{\"count\": %llu, \"sum_seconds\": %.6f, \"buckets\": {", (unsigned long long)histogram->count, histogram->sum_us / 1e6);
+    for(int i = 0; i <= METRICS_BUCKETS; i++) {
+      cumulative += histogram->buckets[i];
+      if(i < METRICS_BUCKETS){
+        printf("\"%g\": %llu, ", metrics_bucket_bounds_us[i] / 1e6, (unsigned long long)cumulative);
+      } else {
+        printf("\"+Inf\": %llu}}", (unsigned long long)cumulative);
+      }
+    }
+    return;
+  }
+
+  for(int i = 0; i <= METRICS_BUCKETS; i++) {
+    cumulative += histogram->buckets[i];
+    if(i < METRICS_BUCKETS){
+      printf("%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, *labels ? "," : "", metrics_bucket_bounds_us[i] / 1e6, (unsigned long long)cumulative);
+    } else {
+      printf("%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, *labels ? "," : "", (unsigned long long)cumulative);
+    }
+  }
+  printf("%s_sum{%s} %.6f\n", name, labels, histogram->sum_us / 1e6);
+  printf("%s_count{%s} %llu\n", name, labels, (unsigned long long)histogram->count);
+
+}
+
+/* print_metrics prints everything in the metrics file in Prometheus text
+ * format, or as JSON, for a monitoring system to scrape */
+void print_metrics(int json) {
+
+  if(metrics == NULL){
+    open_metrics();
+  }
+  if(metrics == NULL){
+    printf("ERROR reading metrics from %s: the file cannot be mapped or has another layout\n", metrics_file);
+    return;
+  }
+
+  if(json){
+    printf("{\n  \"commands\": {");
+  } else {
+    printf("# HELP nextpuzzle_command_runs_total Number of times each command has run.\n");
+    printf("# TYPE nextpuzzle_command_runs_total counter\n");
+  }
+
+  int first = 1;
+  for(int i = 0; i < METRICS_COMMANDS; i++) {
+    uint64_t runs = __atomic_load_n(&metrics->command_runs[i], __ATOMIC_RELAXED);
+    if(runs == 0){
+      continue;
+    }
+    if(json){
+      printf("%s\n    \"%s\": {\"runs\": %llu, \"rows_touched\": %llu, \"duration\": ", first ? "" : ",", metrics_command_names[i],
+          (unsigned long long)runs, (unsigned long long)metrics->rows_touched[i]);
+      print_histogram_metric(NULL, NULL, &metrics->command_duration[i], 1);
+      printf("}");
+    } else {
+      printf("nextpuzzle_command_runs_total{command=\"%s\"} %llu\n", metrics_command_names[i], (unsigned long long)runs);
+    }
+    first = 0;
+  }
+
+  if(json){
+    printf("\n  },\n  \"db_open_duration\": ");
+    print_histogram_metric(NULL, NULL, &metrics->db_open_duration, 1);
+    printf(",\n  \"results_per_day\": {");
+  } else {
+    printf("# HELP nextpuzzle_rows_touched_total Rows inserted, updated or deleted by each command.\n");
+    printf("# TYPE nextpuzzle_rows_touched_total counter\n");
+    for(int i = 0; i < METRICS_COMMANDS; i++) {
+      if(metrics->command_runs[i] > 0){
+        printf("nextpuzzle_rows_touched_total{command=\"%s\"} %llu\n", metrics_command_names[i], (unsigned long long)metrics->rows_touched[i]);
+      }
+    }
+
+    printf("# HELP nextpuzzle_command_duration_seconds End to end latency of each command.\n");
+    printf("# TYPE nextpuzzle_command_duration_seconds histogram\n");
+    for(int i = 0; i < METRICS_COMMANDS; i++) {
+      if(metrics->command_runs[i] > 0){
+        char labels[40];
+        sprintf(labels, "command=\"%s\"", metrics_command_names[i]);
+        print_histogram_metric("nextpuzzle_command_duration_seconds", labels, &metrics->command_duration[i], 0);
+      }
+    }
+
+    printf("# HELP nextpuzzle_db_open_duration_seconds Time taken to open and migrate the database.\n");
+    printf("# TYPE nextpuzzle_db_open_duration_seconds histogram\n");
+    print_histogram_metric("nextpuzzle_db_open_duration_seconds", "", &metrics->db_open_duration, 0);
+
+    printf("# HELP nextpuzzle_results_recorded Results recorded for each of the last %d days.\n", METRICS_RESULT_DAYS);
+    printf("# TYPE nextpuzzle_results_recorded gauge\n");
+  }
+
+  // Walk the ring from its oldest day to its newest so days print in order
+  uint64_t newest = 0;
+  for(int i = 0; i < METRICS_RESULT_DAYS; i++) {
+    uint64_t day_key = __atomic_load_n(&metrics->results_per_day[i], __ATOMIC_RELAXED) >> 32;
+    newest = day_key > newest ? day_key : newest;
+  }
+
+  first = 1;
+  for(uint64_t day_key = newest >= METRICS_RESULT_DAYS ? newest - METRICS_RESULT_DAYS + 1 : 0; newest > 0 && day_key <= newest; day_key++) {
+    uint64_t slot = __atomic_load_n(&metrics->results_per_day[day_key % METRICS_RESULT_DAYS], __ATOMIC_RELAXED);
+    if(slot >> 32 != day_key){
+      continue;
+    }
+    char day[11];
+    day_from_number(day, day_key);
+    if(json){
+      printf("%s\"%s\": %llu", first ? "" : ", ", day, (unsigned long long)(slot & 0xffffffff));
+    } else {
+      printf("nextpuzzle_results_recorded{day=\"%s\"} %llu\n", day, (unsigned long long)(slot & 0xffffffff));
+    }
+    first = 0;
+  }
+
+  if(json){
+    printf("}\n}\n");
+  }
+
+}
+
+/* parse_rating_range parses a --rating argument of the form <min> or
+ * <min>-<max> into queue_min_rating and queue_max_rating, returning false if
+ * it is malformed */
+int parse_rating_range(const char * arg) {
+
+  int min_rating, max_rating;
+  char trailing;
+
+  if(sscanf(arg, "%d-%d%c", &min_rating, &max_rating, &trailing) == 2 && min_rating >= 0 && max_rating >= min_rating){
+    queue_min_rating = min_rating;
+    queue_max_rating = max_rating;
+    return 1;
+  }
+
+  if(sscanf(arg, "%d%c", &min_rating, &trailing) == 1 && min_rating >= 0){
+    queue_min_rating = min_rating;
+    queue_max_rating = INT_MAX;
+    return 1;
+  }
+
+  return 0;
+
+}
+
+/* parse_global_flags removes options that apply to every command (such as
+ * --as-of) from argv, recording their values, and returns the number of
+ * arguments left.  Returns -1 if an option is malformed */
+int parse_global_flags(int argc, char ** argv) {
+
+  int kept = 1;
+
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--as-of") == 0){
+      if(i + 1 >= argc || !is_valid_day(argv[i + 1])){
+        printf("--as-of requires a day in YYYY-MM-DD format\n");
+        return -1;
+      }
+      strcpy(as_of_day, argv[++i]);
+      continue;
+    }
+    if(strcmp(argv[i], "--sandbox") == 0){
+      sandbox_mode = 1;
+      continue;
+    }
+    if(strcmp(argv[i], "--order") == 0){
+      if(i + 1 >= argc || (strcmp(argv[i + 1], "overdue") != 0 && strcmp(argv[i + 1], "score") != 0 && strcmp(argv[i + 1], "random") != 0)){
+        printf("--order requires one of overdue, score or random\n");
+        return -1;
+      }
+      strcpy(queue_order, argv[++i]);
+      continue;
+    }
+    if(strcmp(argv[i], "--theme") == 0){
+      if(i + 1 >= argc || strlen(argv[i + 1]) == 0 || strlen(argv[i + 1]) >= MAX_THEME_LEN){
+        printf("--theme requires a theme name\n");
+        return -1;
+      }
+      i++;
+      normalize_theme(queue_theme, argv[i], strlen(argv[i]));
+      continue;
+    }
+    if(strcmp(argv[i], "--rating") == 0){
+      if(i + 1 >= argc || !parse_rating_range(argv[i + 1])){
+        printf("--rating requires a rating or a range such as 1500-2000\n");
+        return -1;
+      }
+      i++;
+      continue;
+    }
+    argv[kept++] = argv[i];
+  }
+
+  return kept;
+
+}
+
+void get_scores_for_day(sqlite3 * dbc, char * output, const char * day) {
+
+  sqlite3_stmt * get_scores_for_day_stmt;
+
+  int i = 0;
+  sqlite3_prepare_v2(dbc,get_scores_for_date,strlen(get_scores_for_date),&get_scores_for_day_stmt,NULL);
+  sqlite3_bind_text(get_scores_for_day_stmt,1,day,strlen(day),NULL);
+  while(sqlite3_step(get_scores_for_day_stmt) == SQLITE_ROW){
+    const char * fmt = "%d - %d\n";
+    char buf[20];
+    int score = sqlite3_column_int(get_scores_for_day_stmt, 0);
+    int count = sqlite3_column_int(get_scores_for_day_stmt, 1);
+    sprintf(buf, fmt, score, count);
+    if(i == 0){
+      strcpy(output, buf);
+      i++;
+    } else {
+      strcat(output, buf);
+    }
+  }
+}
+
+/* run_command dispatches one command line, with the global options already
+ * removed from argv, to the function that carries it out */
+int run_command(int argc, char** argv) {
+
+  char * command_arg;
+  char * success_arg;
+
+  if(argc == 4 && strcmp(argv[1], "catalog") == 0 && strcmp(argv[2], "import") == 0){
+    import_catalog(argv[3]);
+    return 0;
+  }
+
+  if((argc == 4 || argc == 5) && strcmp(argv[1], "reschedule") == 0 && strcmp(argv[2], "--algorithm") == 0){
+    int algorithm = get_algorithm_by_name(argv[3]);
+    int dry_run = argc == 5 && strcmp(argv[4], "--dry-run") == 0;
+    if(algorithm < 0 || (argc == 5 && !dry_run)){
+      print_useage();
+      return 0;
+    }
+    reschedule_deck(algorithm, dry_run);
+    return 0;
+  }
+
+  if(argc == 4 && strcmp(argv[1], "shuffle") == 0 && strcmp(argv[2], "--seed") == 0){
+    if(strlen(argv[3]) == 0 || strlen(argv[3]) > 18 || strspn(argv[3], "0123456789") != strlen(argv[3])){
+      print_useage();
+      return 0;
+    }
+    shuffle_deck(strtoull(argv[3], NULL, 10));
+    return 0;
+  }
+
+  if((argc == 4 || argc == 5) && strcmp(argv[1], "plan") == 0 && strcmp(argv[2], "--budget") == 0){
+    int dry_run = argc == 5 && strcmp(argv[4], "--dry-run") == 0;
+    if(!isdigit(argv[3][0]) || atoi(argv[3]) < 1 || (argc == 5 && !dry_run)){
+      print_useage();
+      return 0;
+    }
+    plan_budget(atoi(argv[3]), dry_run);
+    return 0;
+  }
+
+  if(argc >= 3 && strcmp(argv[1], "maintain") == 0){
+    int jobs = MAINTAIN_DEFAULT_JOBS;
+    int pages = MAINTAIN_PAGES_PER_STEP;
+    int pause_ms = 0;
+    int quick = 0;
+    for(int i = 3; i < argc; i++) {
+      if(strcmp(argv[i], "--quick") == 0){
+        quick = 1;
+      } else if(i + 1 < argc && isdigit(argv[i + 1][0]) && strcmp(argv[i], "--jobs") == 0) {
+        jobs = atoi(argv[++i]);
+      } else if(i + 1 < argc && isdigit(argv[i + 1][0]) && strcmp(argv[i], "--pages") == 0) {
+        pages = atoi(argv[++i]);
+      } else if(i + 1 < argc && isdigit(argv[i + 1][0]) && strcmp(argv[i], "--pause") == 0) {
+        pause_ms = atoi(argv[++i]);
+      } else {
+        print_useage();
+        return 0;
+      }
+    }
+    if(jobs < 1 || pages < 1){
+      print_useage();
+      return 0;
+    }
+    maintain_databases(argv[2], jobs, pages, pause_ms, quick);
+    return 0;
+  }
+
+  if(argc == 3 && strcmp(argv[1], "metrics") == 0 && strcmp(argv[2], "--json") == 0){
+    print_metrics(1);
+    return 0;
+  }
+
+  if(argc > 3){
+    print_useage();
+    return 0;
+  }
+
+
+  if(argc == 1){
+    get_next();
+    return 0;
+  }
+
+  command_arg = argv[1];
+
+  if(argc == 2) {
+
+    if(strcmp(command_arg, "next") == 0){
+      get_next();
+      return 0;
+    } 
+
+    if(strcmp(command_arg, "stats") == 0){
+      show_stats();
+      return 0;
+    }
+
+    if(strcmp(command_arg, "future") == 0){
+      show_upcoming();
+      return 0;
     }
 
     if(strcmp(command_arg, "useage") == 0){
@@ -877,6 +4350,21 @@ int main(int argc, char** argv) {
       return 0;
     }
 
+    if(strcmp(command_arg, "metrics") == 0){
+      print_metrics(0);
+      return 0;
+    }
+
+    if(strcmp(command_arg, "watch") == 0){
+      watch_due_puzzles();
+      return 0;
+    }
+
+    if(strcmp(command_arg, "rebuild") == 0){
+      rebuild_schedule(0);
+      return 0;
+    }
+
     // Argument is a string of 's' and 'f' and represents a batch update
     if(check_success_string_arg(command_arg)){
       record_batch_results(command_arg);
@@ -906,7 +4394,7 @@ int main(int argc, char** argv) {
     sqlite3 * dbc = get_db_conn();
     get_scores_for_day(dbc, output, success_arg);
     puts(output);
-    sqlite3_close(dbc);
+    release_db_conn(dbc);
     return 0;
   }
 
@@ -915,6 +4403,21 @@ int main(int argc, char** argv) {
     return 0;
   }
 
+  if(strcmp(command_arg, "sync") == 0){
+    sync_database(success_arg);
+    return 0;
+  }
+
+  if(strcmp(command_arg, "snapshot") == 0){
+    snapshot_database(success_arg);
+    return 0;
+  }
+
+  if(strcmp(command_arg, "rebuild") == 0 && strcmp(success_arg, "--check") == 0){
+    rebuild_schedule(1);
+    return 0;
+  }
+
   if(strcmp(command_arg, "n") == 0 && strlen(success_arg) < 10 && isdigit(success_arg[0])){
     get_next_count(atoi(success_arg));
     return 0;
@@ -933,3 +4436,38 @@ int main(int argc, char** argv) {
   return 0;
 
 }
+
+int main(int argc, char** argv) {
+
+  argc = parse_global_flags(argc, argv);
+  if(argc < 0){
+    return 1;
+  }
+
+  // Load the sandbox up front so no command runs without one
+  if(sandbox_mode && get_sandbox_conn() == NULL){
+    return 1;
+  }
+
+  if(sandbox_mode && argc == 1){
+    run_sandbox_session();
+  } else {
+    // Metrics are not kept in --sandbox mode, which writes nothing
+    if(!sandbox_mode){
+      open_metrics();
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    metrics_command = get_command_metric(argc, argv);
+    run_command(argc, argv);
+    record_command_metrics(metrics_command, get_elapsed_us(&start));
+    close_metrics();
+  }
+
+  if(sandbox_dbc != NULL){
+    sqlite3_close(sandbox_dbc);
+  }
+
+  return 0;
+
+}
@@ -1,8 +1,129 @@
 #define MAX_PUZZLE_LEN 20
+#define MAX_THEME_LEN 50
+#define MAX_CATALOG_COLUMNS 20
+#define MAX_SANDBOX_ARGS 16
+#define WATCH_POLL_MS 60000
+#define WATCH_SETTLE_MS 50
 #define STATS_LEN 50
+#define DB_BUSY_TIMEOUT_MS 5000
+#define SPOOL_BUSY_TIMEOUT_MS 0
+#define MAX_SPOOL_LINE 200
 #define BASE_INTERVAL 6
 #define MAX_SUCCESS 4
 #define MAX_INTERVAL 60
+#define ALGORITHM_FIBONACCI 0
+#define ALGORITHM_SM2 1
+#define SM2_INITIAL_EASINESS 2.5
+#define SM2_SUCCESS_GRADE 4
+#define SM2_FAILURE_GRADE 1
+#define RESCHEDULE_MAX_THREADS 8
+#define SNAPSHOT_PAGES_PER_STEP 256
+#define SNAPSHOT_STEP_PAUSE_MS 2
+#define METRICS_MAGIC 0x6e706d6574720001ULL
+#define METRICS_MAX_COMMANDS 32
+#define METRICS_COMMANDS 20
+#define METRICS_COMMAND_ADVANCE 2
+#define METRICS_COMMAND_BATCH 3
+#define METRICS_COMMAND_RESULT 4
+#define METRICS_BUCKETS 12
+#define METRICS_RESULT_DAYS 32
+#define MAINTAIN_DEFAULT_JOBS 4
+#define MAINTAIN_PAGES_PER_STEP 256
+#define MAINTAIN_VACUUM_FREE_PERCENT 25
+#define MAINTAIN_ANALYSIS_LIMIT "1000"
+#define MAINTAIN_AUTO_VACUUM_NONE 0
+#define MAINTAIN_AUTO_VACUUM_INCREMENTAL 2
+
+struct interval_update {
+  int successes;
+  double easiness_factor;
+  int interval;
+};
+
+/* replay_state tracks one puzzle's score and next test day (as a day_number)
+ * while its results are replayed in order */
+struct replay_state {
+  char puzzle_id[MAX_PUZZLE_LEN];
+  int score;
+  int next_day;
+  int results;
+  struct interval_update interval;
+};
+
+/* plan_entry is one puzzle as plan_budget sees it: the day it is scheduled
+ * for (as a day_number), its queue priority and the day the plan gives it */
+struct plan_entry {
+  char puzzle_id[MAX_PUZZLE_LEN];
+  int day;
+  int score;
+  sqlite3_int64 id;
+  sqlite3_int64 shuffle_key;
+  int planned_day;
+};
+
+/* metrics_histogram counts observations in fixed latency buckets, the last
+ * bucket holding everything slower than the largest bound */
+struct metrics_histogram {
+  uint64_t buckets[METRICS_BUCKETS + 1];
+  uint64_t count;
+  uint64_t sum_us;
+};
+
+/* metrics_data is the layout of the metrics file shared by every process.
+ * Change METRICS_MAGIC whenever it changes */
+struct metrics_data {
+  uint64_t magic;
+  uint64_t command_runs[METRICS_MAX_COMMANDS];
+  uint64_t rows_touched[METRICS_MAX_COMMANDS];
+  struct metrics_histogram command_duration[METRICS_MAX_COMMANDS];
+  struct metrics_histogram db_open_duration;
+  uint64_t results_per_day[METRICS_RESULT_DAYS];
+};
+
+/* change_count is the rows a connection's statements changed: pending in the
+ * open transaction and committed.  total is the connection's
+ * sqlite3_total_changes when last looked at */
+struct change_count {
+  int total;
+  int pending;
+  int committed;
+};
+
+/* reschedule_worker is the share of the deck one reschedule thread replays:
+ * every puzzle id from first_puzzle_id to last_puzzle_id inclusive */
+struct reschedule_worker {
+  pthread_t thread;
+  char first_puzzle_id[MAX_PUZZLE_LEN];
+  char last_puzzle_id[MAX_PUZZLE_LEN];
+  char today[11];
+  int algorithm;
+  struct replay_state * states;
+  int count;
+  int capacity;
+  int failed;
+};
+
+/* maintain_job is one database file maintain works on, and what came of it */
+struct maintain_job {
+  char path[PATH_MAX];
+  long duration_ms;
+  long long bytes_reclaimed;
+  int failed;
+  char message[200];
+};
+
+/* maintain_pool is the list of databases maintain's threads share, each thread
+ * claiming the next unclaimed job */
+struct maintain_pool {
+  struct maintain_job * jobs;
+  int count;
+  int capacity;
+  int next;
+  int pages;
+  int pause_ms;
+  int quick;
+  pthread_mutex_t print_lock;
+};
 
 void current_puzzle(sqlite3 *, char *);
 void get_puzzle_at_offset(sqlite3 *, char *, int, char *);
@@ -10,35 +131,121 @@ void get_puzzle_id(char *, char *);
 void get_stats(sqlite3 *, char *);
 void get_target_day(char *, int);
 void get_today(char*);
+FILE * get_report_stream(void);
+const char * get_database_path(void);
+const char * get_queue_statement(void);
+int add_catalog_entry(sqlite3 *, sqlite3_stmt **, const char *, const char *, const char *);
+int begin_write(sqlite3 *);
 int check_advance_arg(char *);
+int commit_write(sqlite3 *);
+int copy_synced_results(sqlite3 *, const char *, const char *, const char *, const char *, sqlite3_int64);
+int compare_maintain_jobs(const void *, const void *);
+int compare_plan_entries(const void *, const void *);
+int copy_file(const char *, const char *);
+int count_rows(sqlite3 *, const char *);
+int day_number(const char *);
+int get_next_due_day(sqlite3 *, char *, char *);
+int get_command_metric(int, char **);
+int get_json_field(const char *, const char *, char *, int);
+int get_pragma_int(sqlite3 *, const char *);
+int is_valid_day(const char *);
+int migrate_schema(sqlite3 *, char *, int);
+int read_schema_version(sqlite3 *);
+int parse_global_flags(int, char **);
+int parse_rating_range(const char *);
+int plan_entry_before(struct plan_entry *, struct plan_entry *);
+int queue_is_filtered(void);
+int replace_file(const char *, const char *);
+int run_command(int, char **);
+int schema_is_current(sqlite3 *);
+int reschedule_synced_puzzles(sqlite3 *, const char *);
+int split_csv_line(char *, char **, int);
+int spool_pending(void);
+int truncate_spool(long, const char *);
 int check_puzzle_exists(sqlite3 * , char *);
 int check_success_arg(char *);
 int check_success_string_arg(char *);
 int database_file_exists(void);
 int fibonacci1(int);
+int get_algorithm_by_name(const char *);
+int get_schedule_algorithm(sqlite3 *, const char *);
 void get_next_test_day_for_puzzle(sqlite3*, char *, char *);
 int get_score_for_puzzle(sqlite3 *, char *);
 int get_total_tests_for_day(sqlite3 *, char *);
 int is_fail(char *);
+long drain_spool(sqlite3 *);
+long get_elapsed_us(struct timespec *);
+long get_ms_until_day(char *);
+long long get_shuffle_multiplier(unsigned long long);
 int is_pass(char *);
 sqlite3* get_db_conn(void);
+sqlite3* get_recording_conn(void);
+sqlite3* get_sandbox_conn(void);
+sqlite3* open_database(const char *, char *, int);
+sqlite3_int64 get_max_result_id(sqlite3 *, const char *);
+struct plan_entry * plan_heap_pop(struct plan_entry **, int *);
 struct tm* get_current_time(void);
 void advance_current_puzzle(int);
-void advance_puzzle_on_success(sqlite3 * , char *);
-void create_new_puzzle_entry(sqlite3 *, char *, char *);
+void bind_queue_filters(sqlite3_stmt *, int);
+int advance_puzzle_on_success(sqlite3 * , char *);
+int create_new_puzzle_entry(sqlite3 *, char *, char *);
+void close_metrics(void);
+void collect_databases(const char *, struct maintain_pool *);
 void create_tables(sqlite3 *);
+void day_from_number(char *, int);
+void end_write_report(int);
 void delete_puzzle(char *);
 void get_next_count(int);
 void get_next(void);
-void log_result(sqlite3 *, char *, char *);
+void get_next_test_on_success(sqlite3 *, char *, int *, char *);
+void get_setting(sqlite3 *, const char *, const char *, char *, int, const char *);
+void import_catalog(char *);
+int log_result(sqlite3 *, char *, char *);
+void maintain_database(struct maintain_job *, int, int, int);
+void maintain_databases(char *, int, int, int, int);
 void mark_current_puzzle(char *);
+void normalize_theme(char *, const char *, int);
+void open_metrics(void);
 void print_error(int, int);
+void print_histogram_metric(const char *, const char *, struct metrics_histogram *, int);
+void print_metrics(int);
+void plan_budget(int, int);
+void plan_heap_push(struct plan_entry **, int *, struct plan_entry *);
+void print_due_histogram(sqlite3 *);
+void register_delta_vfs(void);
 void print_useage(void);
-void reset_puzzle_for_failure(sqlite3 *, char *);
+void record_command_metrics(int, long);
+void record_db_open_metric(long);
+void record_histogram(struct metrics_histogram *, long);
+void record_result_metric(int);
+int count_statement_changes(unsigned, void *, void *, void *);
+void discard_statement_changes(void *);
+void count_changes(sqlite3 *);
+void record_rows_touched(int);
+int reset_puzzle_for_failure(sqlite3 *, char *);
+void rollback_write(sqlite3 *);
+void run_sandbox_session(void);
 void set_puzzle_date(sqlite3 *, char *, char *);
+int set_setting(sqlite3 *, const char *, const char *, const char *);
+void sm2(int, struct interval_update *);
+void snapshot_database(char *);
+void spool_results(const char *, const char *);
+void sync_database(char *);
+void rebuild_schedule(int);
 void record_batch_results(char *);
+void release_db_conn(sqlite3 *);
+void replay_puzzle_history(sqlite3 *, const char *, char *, struct replay_state *, int);
+void replay_result(struct replay_state *, int, const char *, int);
+void * maintain_worker(void *);
+void * replay_partition(void *);
+void free_reschedule_workers(struct reschedule_worker *, int);
+void reschedule_deck(int, int);
+void shuffle_deck(unsigned long long);
+int save_replay_state(sqlite3 *, sqlite3_stmt *, struct replay_state *);
 void show_stats(void);
 void show_upcoming(void);
 void touch_dbfile(void);
-void update_existing_puzzle(sqlite3 *, char *, char *);
+int update_existing_puzzle(sqlite3 *, char *, char *);
 void update_puzzle(char *, char *);
+void wait_for_change(int, long);
+void watch_due_puzzles(void);
@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "stress.h"
+
+/* stress forks many processes that each run a random mix of nextpuzzle
+ * commands against one database, then reports throughput, latency and lock
+ * errors and checks that no result was lost or doubled and that every
+ * puzzle's score matches a replay of the results log.
+ *
+ * Every command runs as of STRESS_WORK_DAY.  A shared pool of puzzles is
+ * seeded due that day for batch strings to work through.  Each process also
+ * owns STRESS_PRIVATE_PUZZLES puzzles it records single results on and
+ * deletes - these are never due on the work day, so no other process touches
+ * them and their expected result counts are exact.  A batch string may be
+ * spooled and recorded later by another process, so for the pool only the
+ * total is exact - but no pool puzzle may be handed out twice */
+
+char const *dbfh = "dailypuzzles.sqlite";
+char const *spool_file = "dailypuzzles.spool";
+char const *seed_puzzle_statement = "insert into puzzles (puzzle_id, score, next_test_date) values (:puzzle_id, 0, '" STRESS_WORK_DAY "')";
+char const *seed_result_statement = "insert into results (puzzle_id, date, result) values (:puzzle_id, '" STRESS_SEED_DAY "', 's')";
+char const *count_puzzle_results_statement = "select count(*) from results where puzzle_id=:puzzle_id";
+char const *count_all_results_statement = "select count(*) from results";
+char const *count_pool_results_statement = "select coalesce(sum(n), 0), coalesce(max(n), 0) from (select count(*) as n from results where cast(puzzle_id as integer)>=:pool_base group by puzzle_id)";
+char const *op_names[] = { "update", "batch", "delete", "next", "future", "stats" };
+int op_weights[] = { 40, 25, 5, 15, 10, 5 };
+char const *useage =
+  "Useage stress [-p processes] [-n operations per process] [-b nextpuzzle binary] [-d work directory] [-s seed]\n";
+
+char binary[PATH_MAX];
+
+/* run_nextpuzzle runs the nextpuzzle binary with args, capturing what it
+ * prints into output and how long it took in microseconds into micros.
+ * Returns the exit status */
+int run_nextpuzzle(char ** args, char * output, long * micros) {
+
+  int pipe_fds[2];
+  struct timespec start, end;
+
+  if(pipe(pipe_fds) != 0){
+    printf("ERROR creating pipe: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pid_t pid = fork();
+  if(pid == 0){
+    dup2(pipe_fds[1], STDOUT_FILENO);
+    dup2(pipe_fds[1], STDERR_FILENO);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    execv(binary, args);
+    _exit(127);
+  }
+  close(pipe_fds[1]);
+
+  int len = 0;
+  ssize_t got;
+  while((got = read(pipe_fds[0], output + len, STRESS_MAX_OUTPUT - 1 - len)) > 0){
+    len += got;
+  }
+  output[len] = '\0';
+  close(pipe_fds[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  *micros = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+}
+
+/* run_worker is the body of one forked process.  It runs <operations> random
+ * commands and writes a line per command to worker-<n>.log: "L <op>
+ * <micros> <lock error> <other error> <spooled>" with its timing, followed by
+ * an "E <puzzle_id> <+1|reset>" line for a result recorded on or a delete of
+ * one of its own puzzles, or a "B <count>" line for a batch string accepted */
+void run_worker(int worker, int operations, unsigned int seed) {
+
+  char log_name[40];
+  sprintf(log_name, "worker-%d.log", worker);
+  FILE * log_file = fopen(log_name, "w");
+
+  int total_weight = 0;
+  for(int i = 0; i < OP_COUNT; i++) {
+    total_weight += op_weights[i];
+  }
+
+  for(int i = 0; i < operations; i++) {
+    int pick = rand_r(&seed) % total_weight;
+    int op = 0;
+    while(pick >= op_weights[op]){
+      pick -= op_weights[op++];
+    }
+
+    char puzzle_id[MAX_PUZZLE_LEN];
+    char results[STRESS_MAX_BATCH + 1];
+    char * args[7] = { binary, "--as-of", STRESS_WORK_DAY, NULL, NULL, NULL, NULL };
+
+    sprintf(puzzle_id, "%d", STRESS_PRIVATE_BASE + worker * 1000 + rand_r(&seed) % STRESS_PRIVATE_PUZZLES);
+
+    switch(op) {
+      case OP_UPDATE:
+        results[0] = rand_r(&seed) % 3 == 0 ? 'f' : 's';
+        results[1] = '\0';
+        args[3] = puzzle_id;
+        args[4] = results;
+        break;
+      case OP_BATCH: {
+        int batch_len = 1 + rand_r(&seed) % STRESS_MAX_BATCH;
+        for(int j = 0; j < batch_len; j++) {
+          results[j] = rand_r(&seed) % 3 == 0 ? 'f' : 's';
+        }
+        results[batch_len] = '\0';
+        args[3] = results;
+        break;
+      }
+      case OP_DELETE:
+        args[3] = "delete";
+        args[4] = puzzle_id;
+        break;
+      default:
+        args[3] = (char *)op_names[op];
+        break;
+    }
+
+    char output[STRESS_MAX_OUTPUT];
+    long micros;
+    run_nextpuzzle(args, output, &micros);
+
+    int spooled = strstr(output, "SPOOLED:") != NULL;
+    int lock_error = !spooled && (strstr(output, "locked") != NULL || strstr(output, "busy") != NULL);
+    int other_error = !lock_error && strstr(output, "ERROR") != NULL;
+    fprintf(log_file, "L %d %ld %d %d %d\n", op, micros, lock_error, other_error, spooled);
+
+    if(op == OP_UPDATE){
+      fprintf(log_file, "E %s +1\n", puzzle_id);
+    } else if(op == OP_DELETE) {
+      fprintf(log_file, "E %s reset\n", puzzle_id);
+    } else if(op == OP_BATCH && strstr(output, "Cannot batch") == NULL) {
+      fprintf(log_file, "B %d\n", (int)strlen(results));
+    }
+  }
+
+  fclose(log_file);
+
+}
+
+/* seed_pool creates the database by running nextpuzzle once, then adds
+ * <pool_size> puzzles that were first passed on STRESS_SEED_DAY - exactly what
+ * recording them with --as-of would have done - so they are due on the work
+ * day for batch strings */
+void seed_pool(int pool_size) {
+
+  char * args[] = { binary, "stats", NULL };
+  char output[STRESS_MAX_OUTPUT];
+  long micros;
+  run_nextpuzzle(args, output, &micros);
+
+  sqlite3 * dbc = 0;
+  sqlite3_stmt * puzzle_stmt;
+  sqlite3_stmt * result_stmt;
+
+  sqlite3_open(dbfh, &dbc);
+  sqlite3_prepare_v2(dbc, seed_puzzle_statement, strlen(seed_puzzle_statement), &puzzle_stmt, NULL);
+  sqlite3_prepare_v2(dbc, seed_result_statement, strlen(seed_result_statement), &result_stmt, NULL);
+
+  sqlite3_exec(dbc, "begin transaction", NULL, NULL, NULL);
+  for(int i = 0; i < pool_size; i++) {
+    char puzzle_id[MAX_PUZZLE_LEN];
+    sprintf(puzzle_id, "%d", STRESS_POOL_BASE + i);
+
+    sqlite3_reset(puzzle_stmt);
+    sqlite3_bind_text(puzzle_stmt,1,puzzle_id,strlen(puzzle_id),SQLITE_TRANSIENT);
+    sqlite3_step(puzzle_stmt);
+
+    sqlite3_reset(result_stmt);
+    sqlite3_bind_text(result_stmt,1,puzzle_id,strlen(puzzle_id),SQLITE_TRANSIENT);
+    sqlite3_step(result_stmt);
+  }
+  sqlite3_exec(dbc, "commit", NULL, NULL, NULL);
+
+  sqlite3_finalize(puzzle_stmt);
+  sqlite3_finalize(result_stmt);
+  sqlite3_close(dbc);
+
+}
+
+/* find_expected returns the expected_count for puzzle_id, adding it with a
+ * count of 0 if it is not in the list yet */
+struct expected_count * find_expected(struct expected_count ** expected, int * count, int * capacity, const char * puzzle_id) {
+
+  for(int i = 0; i < *count; i++) {
+    if(strcmp((*expected)[i].puzzle_id, puzzle_id) == 0){
+      return &(*expected)[i];
+    }
+  }
+
+  if(*count == *capacity){
+    *capacity *= 2;
+    *expected = realloc(*expected, sizeof(struct expected_count) * *capacity);
+  }
+
+  struct expected_count * entry = &(*expected)[(*count)++];
+  snprintf(entry->puzzle_id, MAX_PUZZLE_LEN, "%s", puzzle_id);
+  entry->count = 0;
+
+  return entry;
+
+}
+
+/* check_expected_counts compares the number of results logged for each of the
+ * workers' own puzzles with the number they recorded, checks the pool holds
+ * pool_results results with none handed out twice, and checks there are no
+ * results beyond those.  Returns the number of differences */
+int check_expected_counts(sqlite3 * dbc, struct expected_count * expected, int count, long pool_results) {
+
+  sqlite3_stmt * count_stmt;
+  int mismatches = 0;
+  long total_expected = 0;
+
+  sqlite3_prepare_v2(dbc, count_puzzle_results_statement, strlen(count_puzzle_results_statement), &count_stmt, NULL);
+  for(int i = 0; i < count; i++) {
+    sqlite3_reset(count_stmt);
+    sqlite3_bind_text(count_stmt,1,expected[i].puzzle_id,strlen(expected[i].puzzle_id),NULL);
+    sqlite3_step(count_stmt);
+
+    int logged = sqlite3_column_int(count_stmt, 0);
+    if(logged != expected[i].count){
+      if(mismatches < 10){
+        printf("MISMATCH: puzzle %s has %d results, expected %d\n", expected[i].puzzle_id, logged, expected[i].count);
+      }
+      mismatches++;
+    }
+    total_expected += expected[i].count;
+  }
+  sqlite3_finalize(count_stmt);
+
+  // Each pool puzzle is seeded with one result and is due on the work day
+  // until it gets a second
+  sqlite3_prepare_v2(dbc, count_pool_results_statement, strlen(count_pool_results_statement), &count_stmt, NULL);
+  sqlite3_bind_int(count_stmt, 1, STRESS_POOL_BASE);
+  sqlite3_step(count_stmt);
+  long pool_logged = sqlite3_column_int64(count_stmt, 0);
+  int most_results = sqlite3_column_int(count_stmt, 1);
+  sqlite3_finalize(count_stmt);
+
+  if(pool_logged != pool_results){
+    printf("MISMATCH: %ld results logged for the pool, expected %ld\n", pool_logged, pool_results);
+    mismatches++;
+  }
+  if(most_results > 2){
+    printf("MISMATCH: a pool puzzle was handed out %d times\n", most_results - 1);
+    mismatches++;
+  }
+  total_expected += pool_results;
+
+  sqlite3_prepare_v2(dbc, count_all_results_statement, strlen(count_all_results_statement), &count_stmt, NULL);
+  sqlite3_step(count_stmt);
+  long total_logged = sqlite3_column_int64(count_stmt, 0);
+  sqlite3_finalize(count_stmt);
+
+  if(total_logged != total_expected){
+    printf("MISMATCH: %ld results logged in total, expected %ld\n", total_logged, total_expected);
+    mismatches++;
+  }
+
+  return mismatches;
+
+}
+
+/* check_replay runs nextpuzzle rebuild --check as of the work day and returns
+ * the number of puzzles whose score or date differ from a replay of the
+ * results log */
+int check_replay() {
+
+  char * args[] = { binary, "--as-of", STRESS_WORK_DAY, "rebuild", "--check", NULL };
+  char output[STRESS_MAX_OUTPUT];
+  long micros;
+  int changed = 0, added = 0, removed = 0;
+
+  run_nextpuzzle(args, output, &micros);
+
+  char * pch = strstr(output, "CHANGED:");
+  if(pch == NULL || sscanf(pch, "CHANGED: %d\nADDED: %d\nREMOVED: %d", &changed, &added, &removed) != 3){
+    printf("ERROR running rebuild --check: %s\n", output);
+    return -1;
+  }
+
+  printf("REPLAY: %d changed, %d added, %d removed\n", changed, added, removed);
+
+  return changed + added + removed;
+
+}
+
+int compare_longs(const void * a, const void * b) {
+  long la = *(const long *)a;
+  long lb = *(const long *)b;
+  return (la > lb) - (la < lb);
+}
+
+/* print_latencies prints the median, tail and maximum of count latencies in
+ * microseconds as milliseconds */
+void print_latencies(const char * name, long * latencies, int count) {
+
+  if(count == 0){
+    return;
+  }
+
+  qsort(latencies, count, sizeof(long), compare_longs);
+  printf("LATENCY %-7s n=%-6d p50=%.1fms p95=%.1fms p99=%.1fms max=%.1fms\n", name, count,
+      latencies[count / 2] / 1000.0,
+      latencies[count * 95 / 100] / 1000.0,
+      latencies[count * 99 / 100] / 1000.0,
+      latencies[count - 1] / 1000.0);
+
+}
+
+int main(int argc, char ** argv) {
+
+  int processes = STRESS_DEFAULT_PROCESSES;
+  int operations = STRESS_DEFAULT_OPERATIONS;
+  unsigned int seed = time(NULL);
+  char * binary_arg = "./nextpuzzle";
+  char * work_dir = NULL;
+  char work_dir_template[] = "/tmp/nextpuzzle-stress-XXXXXX";
+  int opt;
+
+  while((opt = getopt(argc, argv, "p:n:b:d:s:")) != -1){
+    switch(opt) {
+      case 'p': processes = atoi(optarg); break;
+      case 'n': operations = atoi(optarg); break;
+      case 'b': binary_arg = optarg; break;
+      case 'd': work_dir = optarg; break;
+      case 's': seed = strtoul(optarg, NULL, 10); break;
+      default: printf("%s", useage); return 1;
+    }
+  }
+
+  if(processes < 1 || operations < 1 || realpath(binary_arg, binary) == NULL){
+    printf("%s", useage);
+    return 1;
+  }
+
+  if(work_dir == NULL){
+    work_dir = mkdtemp(work_dir_template);
+  }
+  if(work_dir == NULL || chdir(work_dir) != 0){
+    printf("ERROR using work directory: %s\n", strerror(errno));
+    return 1;
+  }
+  unlink(dbfh);
+
+  printf("DIRECTORY: %s\nSEED: %u\n", work_dir, seed);
+
+  seed_pool(processes * operations);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for(int i = 0; i < processes; i++) {
+    if(fork() == 0){
+      run_worker(i, operations, seed + i);
+      _exit(0);
+    }
+  }
+  for(int i = 0; i < processes; i++) {
+    wait(NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  long * latencies[OP_COUNT];
+  int latency_counts[OP_COUNT] = { 0 };
+  for(int i = 0; i < OP_COUNT; i++) {
+    latencies[i] = malloc(sizeof(long) * processes * operations);
+  }
+
+  int capacity = 1024;
+  int expected_count = 0;
+  struct expected_count * expected = malloc(sizeof(struct expected_count) * capacity);
+  long pool_results = processes * operations;
+
+  int lock_errors = 0, other_errors = 0, spooled_commands = 0;
+  for(int i = 0; i < processes; i++) {
+    char log_name[40];
+    char line[100];
+    sprintf(log_name, "worker-%d.log", i);
+    FILE * log_file = fopen(log_name, "r");
+
+    while(log_file != NULL && fgets(line, sizeof(line), log_file) != NULL){
+      int op, lock_error, other_error, spooled, batch_count;
+      long micros;
+      char puzzle_id[MAX_PUZZLE_LEN], change[10];
+
+      if(sscanf(line, "L %d %ld %d %d %d", &op, &micros, &lock_error, &other_error, &spooled) == 5){
+        latencies[op][latency_counts[op]++] = micros;
+        lock_errors += lock_error;
+        other_errors += other_error;
+        spooled_commands += spooled;
+      } else if(sscanf(line, "B %d", &batch_count) == 1) {
+        pool_results += batch_count;
+      } else if(sscanf(line, "E %19s %9s", puzzle_id, change) == 2) {
+        struct expected_count * entry = find_expected(&expected, &expected_count, &capacity, puzzle_id);
+        entry->count = strcmp(change, "reset") == 0 ? 0 : entry->count + 1;
+      }
+    }
+
+    if(log_file != NULL){
+      fclose(log_file);
+    }
+  }
+
+  printf("PROCESSES: %d\nOPERATIONS: %d\nDURATION: %.2fs\nTHROUGHPUT: %.1f ops/s\n", processes, processes * operations, seconds, processes * operations / seconds);
+  for(int i = 0; i < OP_COUNT; i++) {
+    print_latencies(op_names[i], latencies[i], latency_counts[i]);
+    free(latencies[i]);
+  }
+  printf("LOCK ERRORS: %d\nOTHER ERRORS: %d\nSPOOLED COMMANDS: %d\n", lock_errors, other_errors, spooled_commands);
+
+  // Any command that writes to the database records what is left in the
+  // spool - deleting a puzzle that was never added changes nothing else
+  char * drain_args[] = { binary, "--as-of", STRESS_WORK_DAY, "delete", "1", NULL };
+  char output[STRESS_MAX_OUTPUT];
+  long micros;
+  run_nextpuzzle(drain_args, output, &micros);
+
+  sqlite3 * dbc = 0;
+  sqlite3_open(dbfh, &dbc);
+  int mismatches = check_expected_counts(dbc, expected, expected_count, pool_results);
+  sqlite3_close(dbc);
+  free(expected);
+
+  struct stat st;
+  if(stat(spool_file, &st) == 0 && st.st_size > 0){
+    printf("MISMATCH: %ld bytes left in the spool\n", (long)st.st_size);
+    mismatches++;
+  }
+
+  printf("RESULT COUNT MISMATCHES: %d\n", mismatches);
+  int replay_differences = check_replay();
+
+  int passed = mismatches == 0 && replay_differences == 0;
+  printf("%s\n", passed ? "PASS" : "FAIL");
+
+  return passed ? 0 : 1;
+
+}
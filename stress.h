@@ -0,0 +1,27 @@
+#define STRESS_DEFAULT_PROCESSES 8
+#define STRESS_DEFAULT_OPERATIONS 200
+#define STRESS_PRIVATE_PUZZLES 20
+#define STRESS_PRIVATE_BASE 100000
+#define STRESS_POOL_BASE 900000
+#define STRESS_MAX_OUTPUT 8192
+#define STRESS_MAX_BATCH 3
+#define STRESS_SEED_DAY "2024-01-01"
+#define STRESS_WORK_DAY "2024-01-02"
+#define MAX_PUZZLE_LEN 20
+
+enum stress_op { OP_UPDATE, OP_BATCH, OP_DELETE, OP_NEXT, OP_FUTURE, OP_STATS, OP_COUNT };
+
+/* expected_count tracks how many results a puzzle should have logged */
+struct expected_count {
+  char puzzle_id[MAX_PUZZLE_LEN];
+  int count;
+};
+
+int check_expected_counts(sqlite3 *, struct expected_count *, int, long);
+int check_replay(void);
+int compare_longs(const void *, const void *);
+int run_nextpuzzle(char **, char *, long *);
+struct expected_count * find_expected(struct expected_count **, int *, int *, const char *);
+void print_latencies(const char *, long *, int);
+void run_worker(int, int, unsigned int);
+void seed_pool(int);